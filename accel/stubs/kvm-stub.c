@@ -50,6 +50,15 @@ int kvm_has_many_ioeventfds(void)
     return 0;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+void kvm_dirty_ring_reap_all(void)
+{
+}
+
 int kvm_update_guest_debug(CPUState *cpu, unsigned long reinject_trap)
 {
     return -ENOSYS;
@@ -160,11 +160,23 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_fixed:1;
+    bool use_io_uring_iopoll:1;
+    /* IOPOLL failed, switch to the normal ring once the IOPOLL ring is idle */
+    bool io_uring_iopoll_unsupported:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
+    /* Index of s->fd in the registered files of the io_uring, or -1 */
+    int fixed_file_index;
+#ifdef CONFIG_LINUX_IO_URING
+    /* Reads and writes in flight on the IOPOLL ring */
+    unsigned int io_uring_iopoll_in_flight;
+    /* Ring plugged by raw_aio_plug(), the node may switch rings until unplug */
+    LuringState *io_uring_plugged;
+#endif
     struct {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
@@ -499,6 +511,62 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags, bool has_writers)
     }
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Returns the io_uring that reads and writes of this node are submitted to */
+static LuringState *raw_luring_rw_state(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+
+    if (s->use_io_uring_iopoll) {
+        return aio_get_linux_io_uring_iopoll(ctx);
+    }
+    return aio_get_linux_io_uring(ctx);
+}
+
+/*
+ * Returns the index of s->fd in the registered files of @aio, which must be
+ * raw_luring_rw_state(), registering it on first use, or -1 if requests
+ * must use the plain file descriptor.
+ */
+static int raw_luring_fixed_file(BlockDriverState *bs, LuringState *aio)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    if (!s->use_io_uring_fixed || s->fixed_file_index >= 0) {
+        return s->fixed_file_index;
+    }
+
+    ret = luring_register_file(aio, s->fd);
+    if (ret < 0) {
+        warn_report("Unable to register '%s' with io_uring, falling back "
+                    "to unregistered file: %s", bs->filename, strerror(-ret));
+        s->use_io_uring_fixed = false;
+        return -1;
+    }
+    s->fixed_file_index = ret;
+    return ret;
+}
+#endif
+
+/*
+ * Must be called before s->fd is closed or replaced, and before the node
+ * leaves its AioContext, because a registered file keeps a reference to
+ * the file in the ring.
+ */
+static void raw_luring_unregister_file(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->fixed_file_index >= 0) {
+        luring_unregister_file(raw_luring_rw_state(bs), s->fixed_file_index);
+        s->fixed_file_index = -1;
+    }
+#endif
+}
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -519,6 +587,17 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native, io_uring)",
         },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll for io_uring completions (default: off)",
+        },
+        {
+            .name = "io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the file and bounce buffers with io_uring "
+                    "(default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -598,6 +677,20 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
 #endif
 
+    s->fixed_file_index = -1;
+    s->use_io_uring_fixed = qemu_opt_get_bool(opts, "io-uring-fixed", false);
+    if (s->use_io_uring_fixed && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed=on requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->use_io_uring_iopoll = qemu_opt_get_bool(opts, "io-uring-iopoll", false);
+    if (s->use_io_uring_iopoll && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-iopoll=on requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
                               ON_OFF_AUTO_AUTO, &local_err);
@@ -697,6 +790,21 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
             goto fail;
         }
     }
+    /* Polled I/O is only supported for O_DIRECT reads and writes */
+    if (s->use_io_uring_iopoll) {
+        if (!(s->open_flags & O_DIRECT)) {
+            error_setg(errp, "io-uring-iopoll=on was specified, but it "
+                             "requires cache.direct=on, which was not "
+                             "specified.");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (!aio_setup_linux_io_uring_iopoll(bdrv_get_aio_context(bs),
+                                             errp)) {
+            error_prepend(errp, "Unable to use io_uring polled I/O: ");
+            goto fail;
+        }
+    }
 #else
     if (s->use_linux_io_uring) {
         error_setg(errp, "aio=io_uring was specified, but is not supported "
@@ -1146,6 +1254,7 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+    raw_luring_unregister_file(state->bs);
     qemu_close(s->fd);
     s->fd = rs->fd;
 
@@ -1991,6 +2100,65 @@ static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
     return thread_pool_submit_co(pool, func, arg);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Submits a read or write to the IOPOLL ring if the node uses one, and to
+ * the normal ring otherwise or if the file system can't poll.
+ */
+static int coroutine_fn raw_luring_co_prw(BlockDriverState *bs,
+                                          uint64_t offset, QEMUIOVector *qiov,
+                                          int type)
+{
+    BDRVRawState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    LuringState *aio;
+    int ret;
+
+    if (!s->use_io_uring_iopoll) {
+        aio = aio_get_linux_io_uring(ctx);
+        return luring_co_submit(bs, aio, s->fd, raw_luring_fixed_file(bs, aio),
+                                offset, qiov, type);
+    }
+
+    if (s->io_uring_iopoll_unsupported) {
+        /* s->fd may only be registered with the IOPOLL ring */
+        return luring_co_submit(bs, aio_get_linux_io_uring(ctx), s->fd, -1,
+                                offset, qiov, type);
+    }
+
+    aio = aio_get_linux_io_uring_iopoll(ctx);
+    s->io_uring_iopoll_in_flight++;
+    ret = luring_co_submit(bs, aio, s->fd, raw_luring_fixed_file(bs, aio),
+                           offset, qiov, type);
+    s->io_uring_iopoll_in_flight--;
+
+    if (ret == -EOPNOTSUPP) {
+        /*
+         * The file system can't poll for completions, e.g. tmpfs.  The
+         * kernel only reports this when the request is issued.
+         */
+        if (!s->io_uring_iopoll_unsupported) {
+            warn_report("io_uring polled I/O is not supported for '%s', "
+                        "falling back to interrupts", bs->filename);
+            s->io_uring_iopoll_unsupported = true;
+        }
+        ret = luring_co_submit(bs, aio_get_linux_io_uring(ctx), s->fd, -1,
+                               offset, qiov, type);
+    }
+
+    /*
+     * The registered file can only be dropped once no request uses it, so
+     * the switch to the normal ring happens when the IOPOLL ring is idle.
+     */
+    if (s->io_uring_iopoll_unsupported && !s->io_uring_iopoll_in_flight) {
+        raw_luring_unregister_file(bs);
+        s->use_io_uring_iopoll = false;
+        s->io_uring_iopoll_unsupported = false;
+    }
+    return ret;
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -2010,9 +2178,8 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
         assert(qiov->size == bytes);
-        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        return raw_luring_co_prw(bs, offset, qiov, type);
 #endif
 #ifdef CONFIG_LINUX_AIO
     } else if (s->use_linux_aio) {
@@ -2064,8 +2231,8 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_plug(bs, aio);
+        s->io_uring_plugged = raw_luring_rw_state(bs);
+        luring_io_plug(bs, s->io_uring_plugged);
     }
 #endif
 }
@@ -2081,8 +2248,8 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_unplug(bs, aio);
+        luring_io_unplug(bs, s->io_uring_plugged);
+        s->io_uring_plugged = NULL;
     }
 #endif
 }
@@ -2106,13 +2273,23 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
+        /* IOPOLL rings don't support fsync, use the normal ring */
         LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        int fixed_file = s->use_io_uring_iopoll ?
+                         -1 : raw_luring_fixed_file(bs, aio);
+        return luring_co_submit(bs, aio, s->fd, fixed_file, 0, NULL,
+                                QEMU_AIO_FLUSH);
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    /* Registered again with the new ring on next use */
+    raw_luring_unregister_file(bs);
+}
+
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
@@ -2134,6 +2311,15 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
             error_reportf_err(local_err, "Unable to use linux io_uring, "
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
+            s->use_io_uring_iopoll = false;
+        }
+    }
+    if (s->use_io_uring_iopoll) {
+        Error *local_err = NULL;
+        if (!aio_setup_linux_io_uring_iopoll(new_context, &local_err)) {
+            error_reportf_err(local_err, "Unable to use io_uring polled I/O, "
+                                         "falling back to interrupts: ");
+            s->use_io_uring_iopoll = false;
         }
     }
 #endif
@@ -2144,6 +2330,7 @@ static void raw_close(BlockDriverState *bs)
     BDRVRawState *s = bs->opaque;
 
     if (s->fd >= 0) {
+        raw_luring_unregister_file(bs);
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -3146,6 +3333,7 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_luring_unregister_file(bs);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3247,6 +3435,7 @@ BlockDriver bdrv_file = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
@@ -3621,6 +3810,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
@@ -3745,6 +3935,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -3799,8 +3990,10 @@ static int cdrom_reopen(BlockDriverState *bs)
      * Force reread of possibly changed/newly loaded disc,
      * FreeBSD seems to not notice sometimes...
      */
-    if (s->fd >= 0)
+    if (s->fd >= 0) {
+        raw_luring_unregister_file(bs);
         qemu_close(s->fd);
+    }
     fd = qemu_open(bs->filename, s->open_flags, NULL);
     if (fd < 0) {
         s->fd = -1;
@@ -3875,6 +4068,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -10,9 +10,12 @@
  */
 #include "qemu/osdep.h"
 #include <liburing.h>
+#include <sys/syscall.h>
 #include "qemu-common.h"
 #include "block/aio.h"
+#include "qemu/bitmap.h"
 #include "qemu/queue.h"
+#include "qemu/units.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
@@ -22,12 +25,31 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Linux 5.11, SQPOLL without registered files and CAP_SYS_ADMIN */
+#ifndef IORING_FEAT_SQPOLL_NONFIXED
+#define IORING_FEAT_SQPOLL_NONFIXED (1U << 7)
+#endif
+
+/* Size of the registered file table of a ring */
+#define LURING_FIXED_FILES 64
+
+/*
+ * Requests on registered files that fit in a slot go through a registered
+ * bounce buffer, so that the kernel does not have to pin the guest pages
+ * for each request.
+ */
+#define LURING_BUF_SLOTS MAX_ENTRIES
+#define LURING_BUF_SLOT_SIZE (64 * KiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
+    uint64_t offset;
+    /* Registered bounce buffer slot, or NULL */
+    uint8_t *bounce;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
     /*
@@ -56,8 +78,56 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /*
+     * With SQPOLL a kernel thread picks up submissions, and io_uring_enter()
+     * is only needed to wake it up after it went idle.
+     */
+    bool sqpoll;
+    uint64_t sqpoll_submits;
+    uint64_t sqpoll_wakeups;
+
+    /* Completions are reaped by polling the device, see luring_iopoll() */
+    bool iopoll;
+
+    /*
+     * Registered files, -1 for free slots.  NULL until the first file is
+     * registered.  Protected by AioContext lock.
+     */
+    int *fixed_files;
+    bool fixed_files_failed;
+
+    /* Registered bounce buffers, NULL if they could not be registered */
+    uint8_t *bufs;
+    DECLARE_BITMAP(free_bufs, LURING_BUF_SLOTS);
 } LuringState;
 
+static bool luring_get_bounce(LuringState *s, LuringAIOCB *luringcb)
+{
+    unsigned long slot;
+
+    if (!s->bufs || luringcb->qiov->size > LURING_BUF_SLOT_SIZE) {
+        return false;
+    }
+
+    slot = find_first_bit(s->free_bufs, LURING_BUF_SLOTS);
+    if (slot >= LURING_BUF_SLOTS) {
+        return false;
+    }
+    clear_bit(slot, s->free_bufs);
+    luringcb->bounce = s->bufs + slot * LURING_BUF_SLOT_SIZE;
+    return true;
+}
+
+static void luring_put_bounce(LuringState *s, LuringAIOCB *luringcb)
+{
+    if (luringcb->bounce) {
+        set_bit((luringcb->bounce - s->bufs) / LURING_BUF_SLOT_SIZE,
+                s->free_bufs);
+        luringcb->bounce = NULL;
+    }
+}
+
 /**
  * luring_resubmit:
  *
@@ -92,6 +162,14 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read = nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->bounce) {
+        luringcb->sqeq.off = luringcb->offset + nread;
+        luringcb->sqeq.addr = (__u64)(uintptr_t)(luringcb->bounce + nread);
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -103,13 +181,26 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
                       remaining);
 
     /* Update sqe */
-    luringcb->sqeq.off = nread;
+    luringcb->sqeq.off = luringcb->offset + nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
 
     luring_resubmit(s, luringcb);
 }
 
+/*
+ * IOPOLL rings never signal completions, they are only posted when the
+ * device is polled by io_uring_enter(IORING_ENTER_GETEVENTS).  With
+ * min_complete = 0 this does a single non-blocking pass.
+ */
+static void luring_iopoll(LuringState *s)
+{
+    if (s->iopoll && s->io_q.in_flight) {
+        syscall(__NR_io_uring_enter, s->ring.ring_fd, 0, 0,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -144,6 +235,8 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    luring_iopoll(s);
+
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -172,15 +265,23 @@ static void luring_process_completions(LuringState *s)
         } else if (!luringcb->qiov) {
             goto end;
         } else if (total_bytes == luringcb->qiov->size) {
+            if (luringcb->bounce && luringcb->is_read) {
+                qemu_iovec_from_buf(luringcb->qiov, 0, luringcb->bounce,
+                                    total_bytes);
+            }
             ret = 0;
         /* Only read/write */
         } else {
             /* Short Read/Write */
             if (luringcb->is_read) {
                 if (ret > 0) {
-                    luring_resubmit_short_read(s, luringcb, ret);
+                    luring_resubmit_short_read(s, luringcb, total_bytes);
                     continue;
                 } else {
+                    if (luringcb->bounce) {
+                        qemu_iovec_from_buf(luringcb->qiov, 0,
+                                            luringcb->bounce, total_bytes);
+                    }
                     /* Pad with zeroes */
                     qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
                                       luringcb->qiov->size - total_bytes);
@@ -192,6 +293,7 @@ static void luring_process_completions(LuringState *s)
         }
 end:
         luringcb->ret = ret;
+        luring_put_bounce(s, luringcb);
         qemu_iovec_destroy(&luringcb->resubmit_qiov);
 
         /*
@@ -204,7 +306,14 @@ end:
             aio_co_wake(luringcb->co);
         }
     }
-    qemu_bh_cancel(s->completion_bh);
+
+    /*
+     * Nothing will wake up the event loop when an IOPOLL request completes,
+     * so keep the BH scheduled and busy poll until all requests are done.
+     */
+    if (!s->iopoll || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 }
 
 static int ioq_submit(LuringState *s)
@@ -227,6 +336,16 @@ static int ioq_submit(LuringState *s)
             *sqes = luringcb->sqeq;
             QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
         }
+        if (s->sqpoll) {
+            /* Same check as liburing does before calling io_uring_enter() */
+            smp_mb();
+            s->sqpoll_submits++;
+            if (qatomic_read(s->ring.sq.kflags) & IORING_SQ_NEED_WAKEUP) {
+                s->sqpoll_wakeups++;
+                trace_luring_sqpoll_wakeup(s, s->sqpoll_wakeups,
+                                           s->sqpoll_submits);
+            }
+        }
         ret = io_uring_submit(&s->ring);
         trace_luring_io_uring_submit(s, ret);
         /* Prevent infinite loop if submission is refused */
@@ -278,6 +397,8 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    luring_iopoll(s);
+
     if (io_uring_cq_ready(&s->ring)) {
         luring_process_completions_and_submit(s);
         return true;
@@ -315,6 +436,7 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
+ * @fixed_file: index of the file in the registered files, or -1
  * @luringcb: AIO control block
  * @s: AIO state
  * @offset: offset for request
@@ -323,18 +445,34 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
  * Fetches sqes from ring, adds to pending queue and preps them
  *
  */
-static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+static int luring_do_submit(int fd, int fixed_file, LuringAIOCB *luringcb,
+                            LuringState *s, uint64_t offset, int type)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
 
+    if (fixed_file >= 0) {
+        fd = fixed_file;
+    }
+
     switch (type) {
     case QEMU_AIO_WRITE:
+        if (fixed_file >= 0 && luring_get_bounce(s, luringcb)) {
+            qemu_iovec_to_buf(luringcb->qiov, 0, luringcb->bounce,
+                              luringcb->qiov->size);
+            io_uring_prep_write_fixed(sqes, fd, luringcb->bounce,
+                                      luringcb->qiov->size, offset, 0);
+            break;
+        }
         io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
+        if (fixed_file >= 0 && luring_get_bounce(s, luringcb)) {
+            io_uring_prep_read_fixed(sqes, fd, luringcb->bounce,
+                                     luringcb->qiov->size, offset, 0);
+            break;
+        }
         io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
                             luringcb->qiov->niov, offset);
         break;
@@ -346,6 +484,9 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (fixed_file >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -363,7 +504,8 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
-                                  uint64_t offset, QEMUIOVector *qiov, int type)
+                                  int fixed_file, uint64_t offset,
+                                  QEMUIOVector *qiov, int type)
 {
     int ret;
     LuringAIOCB luringcb = {
@@ -371,12 +513,14 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
+        .offset     = offset,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(fd, fixed_file, &luringcb, s, offset, type);
 
     if (ret < 0) {
+        luring_put_bounce(s, &luringcb);
         return ret;
     }
 
@@ -402,29 +546,173 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(bool iopoll, bool sqpoll, uint32_t sqpoll_idle_ms,
+                         int sqpoll_cpu, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = { 0 };
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (iopoll) {
+        params.flags |= IORING_SETUP_IOPOLL;
+    }
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = sqpoll_idle_ms;
+        if (sqpoll_cpu >= 0) {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = sqpoll_cpu;
+        }
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        /*
+         * Don't fall back to normal submission silently, SQPOLL was
+         * requested explicitly.
+         */
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring%s",
+                         sqpoll ? " in SQPOLL mode" : "");
         g_free(s);
         return NULL;
     }
 
+    if (sqpoll && !(params.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+        error_setg(errp, "io_uring SQPOLL mode requires Linux 5.11 or newer");
+        io_uring_queue_exit(ring);
+        g_free(s);
+        return NULL;
+    }
+
+    s->iopoll = iopoll;
+    s->sqpoll = sqpoll;
     ioq_init(&s->io_q);
     return s;
 
 }
 
+bool luring_get_sqpoll_stats(LuringState *s, uint64_t *submits,
+                             uint64_t *wakeups)
+{
+    if (!s->sqpoll) {
+        return false;
+    }
+    *submits = s->sqpoll_submits;
+    *wakeups = s->sqpoll_wakeups;
+    return true;
+}
+
+static void luring_setup_fixed_bufs(LuringState *s)
+{
+    size_t size = LURING_BUF_SLOTS * LURING_BUF_SLOT_SIZE;
+    struct iovec iov;
+    int ret;
+
+    s->bufs = qemu_try_memalign(qemu_real_host_page_size, size);
+    if (!s->bufs) {
+        return;
+    }
+
+    iov.iov_base = s->bufs;
+    iov.iov_len = size;
+    ret = io_uring_register_buffers(&s->ring, &iov, 1);
+    trace_luring_register_buffers(s, size, ret);
+    if (ret < 0) {
+        /* e.g. RLIMIT_MEMLOCK too low, registered files still help */
+        qemu_vfree(s->bufs);
+        s->bufs = NULL;
+        return;
+    }
+    bitmap_set(s->free_bufs, 0, LURING_BUF_SLOTS);
+}
+
+static int luring_setup_fixed_files(LuringState *s)
+{
+    int i, ret;
+
+    s->fixed_files = g_new(int, LURING_FIXED_FILES);
+    for (i = 0; i < LURING_FIXED_FILES; i++) {
+        s->fixed_files[i] = -1;
+    }
+
+    /* A sparse table, slots are filled by luring_register_file() */
+    ret = io_uring_register_files(&s->ring, s->fixed_files,
+                                  LURING_FIXED_FILES);
+    if (ret < 0) {
+        g_free(s->fixed_files);
+        s->fixed_files = NULL;
+        s->fixed_files_failed = true;
+        return ret;
+    }
+
+    luring_setup_fixed_bufs(s);
+    return 0;
+}
+
+/**
+ * luring_register_file:
+ * @s: AIO state
+ * @fd: file descriptor to register
+ *
+ * Registers @fd with the ring, and the ring's bounce buffers on first use.
+ * Requests submitted with the returned index skip the per-request file
+ * lookup, and the small ones use the registered bounce buffers.
+ *
+ * Returns: the index of @fd in the registered files, or -errno.
+ */
+int luring_register_file(LuringState *s, int fd)
+{
+    int i, ret;
+
+    if (!s->fixed_files) {
+        if (s->fixed_files_failed) {
+            return -ENOTSUP;
+        }
+        ret = luring_setup_fixed_files(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < LURING_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == -1) {
+            ret = io_uring_register_files_update(&s->ring, i, &fd, 1);
+            if (ret < 0) {
+                return ret;
+            }
+            s->fixed_files[i] = fd;
+            trace_luring_register_file(s, fd, i);
+            return i;
+        }
+    }
+    return -ENOSPC;
+}
+
+/**
+ * luring_unregister_file:
+ * @s: AIO state
+ * @index: index returned by luring_register_file()
+ *
+ * No request may be in flight on the file.
+ */
+void luring_unregister_file(LuringState *s, int index)
+{
+    int fd = -1;
+
+    assert(s->fixed_files && s->fixed_files[index] != -1);
+    trace_luring_unregister_file(s, s->fixed_files[index], index);
+    io_uring_register_files_update(&s->ring, index, &fd, 1);
+    s->fixed_files[index] = -1;
+}
+
 void luring_cleanup(LuringState *s)
 {
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
+    g_free(s->fixed_files);
+    qemu_vfree(s->bufs);
     g_free(s);
 }
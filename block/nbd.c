@@ -48,7 +48,9 @@
 #include "qemu/yank.h"
 
 #define EN_OPTSTR ":exportname="
-#define MAX_NBD_REQUESTS    16
+#define NBD_DEFAULT_QUEUE_DEPTH 16
+#define NBD_MAX_QUEUE_DEPTH     1024
+#define NBD_MAX_CONNECTIONS     16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -127,12 +129,22 @@ typedef struct BDRVNBDState {
 
     QEMUTimer *reconnect_delay_timer;
 
-    NBDClientRequest requests[MAX_NBD_REQUESTS];
+    NBDClientRequest *requests;
+    int max_requests;
     NBDReply reply;
     BlockDriverState *bs;
 
+    /*
+     * All connections to the export, conns[0] being bs->opaque itself. Only
+     * set in bs->opaque: the additional connections are BDRVNBDState objects
+     * of their own that borrow the connection parameters below from it.
+     */
+    struct BDRVNBDState **conns;
+    int nb_conns;
+
     /* Connection parameters */
     uint32_t reconnect_delay;
+    uint32_t multi_conn;
     SocketAddress *saddr;
     char *export, *tlscredsid;
     QCryptoTLSCreds *tlscreds;
@@ -144,12 +156,11 @@ typedef struct BDRVNBDState {
     NBDConnectThread *connect_thread;
 } BDRVNBDState;
 
-static int nbd_establish_connection(BlockDriverState *bs, SocketAddress *saddr,
+static int nbd_establish_connection(BDRVNBDState *s, SocketAddress *saddr,
                                     Error **errp);
-static int nbd_co_establish_connection(BlockDriverState *bs, Error **errp);
-static void nbd_co_establish_connection_cancel(BlockDriverState *bs,
-                                               bool detach);
-static int nbd_client_handshake(BlockDriverState *bs, Error **errp);
+static int nbd_co_establish_connection(BDRVNBDState *s, Error **errp);
+static void nbd_co_establish_connection_cancel(BDRVNBDState *s, bool detach);
+static int nbd_client_handshake(BDRVNBDState *s, Error **errp);
 static void nbd_yank(void *opaque);
 
 static void nbd_clear_bdrvstate(BDRVNBDState *s)
@@ -163,6 +174,8 @@ static void nbd_clear_bdrvstate(BDRVNBDState *s)
     s->tlscredsid = NULL;
     g_free(s->x_dirty_bitmap);
     s->x_dirty_bitmap = NULL;
+    g_free(s->requests);
+    s->requests = NULL;
 }
 
 static void nbd_channel_error(BDRVNBDState *s, int ret)
@@ -184,7 +197,7 @@ static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
 {
     int i;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->max_requests; i++) {
         NBDClientRequest *req = &s->requests[i];
 
         if (req->coroutine && req->receiving) {
@@ -229,10 +242,8 @@ static void reconnect_delay_timer_init(BDRVNBDState *s, uint64_t expire_time_ns)
     timer_mod(s->reconnect_delay_timer, expire_time_ns);
 }
 
-static void nbd_client_detach_aio_context(BlockDriverState *bs)
+static void nbd_detach_connection(BDRVNBDState *s)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-
     /* Timer is deleted in nbd_client_co_drain_begin() */
     assert(!s->reconnect_delay_timer);
     /*
@@ -245,19 +256,33 @@ static void nbd_client_detach_aio_context(BlockDriverState *bs)
     }
 }
 
+static void nbd_client_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_detach_connection(s->conns[i]);
+    }
+}
+
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    if (s->connection_co) {
-        /*
-         * The node is still drained, so we know the coroutine has yielded in
-         * nbd_read_eof(), the only place where bs->in_flight can reach 0, or
-         * it is entered for the first time. Both places are safe for entering
-         * the coroutine.
-         */
-        qemu_aio_coroutine_enter(bs->aio_context, s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i]->connection_co) {
+            /*
+             * The node is still drained, so we know the coroutine has yielded
+             * in nbd_read_eof(), the only place where bs->in_flight can reach
+             * 0, or it is entered for the first time. Both places are safe for
+             * entering the coroutine.
+             */
+            qemu_aio_coroutine_enter(bs->aio_context,
+                                     s->conns[i]->connection_co);
+        }
     }
     bdrv_dec_in_flight(bs);
 }
@@ -266,13 +291,18 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
                                           AioContext *new_context)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    /*
-     * s->connection_co is either yielded from nbd_receive_reply or from
-     * nbd_co_reconnect_loop()
-     */
-    if (qatomic_load_acquire(&s->state) == NBD_CLIENT_CONNECTED) {
-        qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
+    for (i = 0; i < s->nb_conns; i++) {
+        BDRVNBDState *c = s->conns[i];
+
+        /*
+         * c->connection_co is either yielded from nbd_receive_reply or from
+         * nbd_co_reconnect_loop()
+         */
+        if (qatomic_load_acquire(&c->state) == NBD_CLIENT_CONNECTED) {
+            qio_channel_attach_aio_context(QIO_CHANNEL(c->ioc), new_context);
+        }
     }
 
     bdrv_inc_in_flight(bs);
@@ -284,16 +314,14 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
     aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, bs);
 }
 
-static void coroutine_fn nbd_client_co_drain_begin(BlockDriverState *bs)
+static void coroutine_fn nbd_co_drain_connection_begin(BDRVNBDState *s)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-
     s->drained = true;
     if (s->connection_co_sleep_ns_state) {
         qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
     }
 
-    nbd_co_establish_connection_cancel(bs, false);
+    nbd_co_establish_connection_cancel(s, false);
 
     reconnect_delay_timer_del(s);
 
@@ -303,22 +331,35 @@ static void coroutine_fn nbd_client_co_drain_begin(BlockDriverState *bs)
     }
 }
 
-static void coroutine_fn nbd_client_co_drain_end(BlockDriverState *bs)
+static void coroutine_fn nbd_client_co_drain_begin(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    s->drained = false;
-    if (s->wait_drained_end) {
-        s->wait_drained_end = false;
-        aio_co_wake(s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_co_drain_connection_begin(s->conns[i]);
     }
 }
 
-
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void coroutine_fn nbd_client_co_drain_end(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        BDRVNBDState *c = s->conns[i];
+
+        c->drained = false;
+        if (c->wait_drained_end) {
+            c->wait_drained_end = false;
+            aio_co_wake(c->connection_co);
+        }
+    }
+}
 
+
+static void nbd_teardown_connection(BDRVNBDState *s)
+{
     if (s->ioc) {
         /* finish any pending coroutines */
         qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -333,7 +374,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
         if (s->connection_co_sleep_ns_state) {
             qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
         }
-        nbd_co_establish_connection_cancel(bs, true);
+        nbd_co_establish_connection_cancel(s, true);
     }
     if (qemu_in_coroutine()) {
         s->teardown_co = qemu_coroutine_self();
@@ -341,7 +382,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
         qemu_coroutine_yield();
         s->teardown_co = NULL;
     } else {
-        BDRV_POLL_WHILE(bs, s->connection_co);
+        BDRV_POLL_WHILE(s->bs, s->connection_co);
     }
     assert(!s->connection_co);
 }
@@ -436,11 +477,10 @@ static void *connect_thread_func(void *opaque)
 }
 
 static int coroutine_fn
-nbd_co_establish_connection(BlockDriverState *bs, Error **errp)
+nbd_co_establish_connection(BDRVNBDState *s, Error **errp)
 {
     int ret;
     QemuThread thread;
-    BDRVNBDState *s = bs->opaque;
     NBDConnectThread *thr = s->connect_thread;
 
     qemu_mutex_lock(&thr->mutex);
@@ -459,8 +499,8 @@ nbd_co_establish_connection(BlockDriverState *bs, Error **errp)
         thr->state = CONNECT_THREAD_NONE;
         s->sioc = thr->sioc;
         thr->sioc = NULL;
-        yank_register_function(BLOCKDEV_YANK_INSTANCE(bs->node_name),
-                               nbd_yank, bs);
+        yank_register_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
+                               nbd_yank, s);
         qemu_mutex_unlock(&thr->mutex);
         return 0;
     case CONNECT_THREAD_RUNNING:
@@ -497,8 +537,8 @@ nbd_co_establish_connection(BlockDriverState *bs, Error **errp)
         s->sioc = thr->sioc;
         thr->sioc = NULL;
         if (s->sioc) {
-            yank_register_function(BLOCKDEV_YANK_INSTANCE(bs->node_name),
-                                   nbd_yank, bs);
+            yank_register_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
+                                   nbd_yank, s);
         }
         ret = (s->sioc ? 0 : -1);
         break;
@@ -538,10 +578,8 @@ nbd_co_establish_connection(BlockDriverState *bs, Error **errp)
  * to CONNECT_THREAD_RUNNING_DETACHED state). s->connect_thread becomes NULL if
  * detach is true.
  */
-static void nbd_co_establish_connection_cancel(BlockDriverState *bs,
-                                               bool detach)
+static void nbd_co_establish_connection_cancel(BDRVNBDState *s, bool detach)
 {
-    BDRVNBDState *s = bs->opaque;
     NBDConnectThread *thr = s->connect_thread;
     bool wake = false;
     bool do_free = false;
@@ -612,21 +650,21 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
     if (s->ioc) {
         qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
-                                 nbd_yank, s->bs);
+                                 nbd_yank, s);
         object_unref(OBJECT(s->sioc));
         s->sioc = NULL;
         object_unref(OBJECT(s->ioc));
         s->ioc = NULL;
     }
 
-    if (nbd_co_establish_connection(s->bs, &local_err) < 0) {
+    if (nbd_co_establish_connection(s, &local_err) < 0) {
         ret = -ECONNREFUSED;
         goto out;
     }
 
     bdrv_dec_in_flight(s->bs);
 
-    ret = nbd_client_handshake(s->bs, &local_err);
+    ret = nbd_client_handshake(s, &local_err);
 
     if (s->drained) {
         s->wait_drained_end = true;
@@ -739,7 +777,7 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * one coroutine is called until the reply finishes.
          */
         i = HANDLE_TO_INDEX(s, s->reply.handle);
-        if (i >= MAX_NBD_REQUESTS ||
+        if (i >= s->max_requests ||
             !s->requests[i].coroutine ||
             !s->requests[i].receiving ||
             (nbd_reply_is_structured(&s->reply) && !s->info.structured_reply))
@@ -772,7 +810,7 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
     if (s->ioc) {
         qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
-                                 nbd_yank, s->bs);
+                                 nbd_yank, s);
         object_unref(OBJECT(s->sioc));
         s->sioc = NULL;
         object_unref(OBJECT(s->ioc));
@@ -785,15 +823,40 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/*
+ * Pick the connection to send a new request on: the one with the fewest
+ * requests in flight among those that are connected.
+ */
+static BDRVNBDState *nbd_choose_connection(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *best = s;
+    int i;
+
+    for (i = 1; i < s->nb_conns; i++) {
+        BDRVNBDState *c = s->conns[i];
+
+        if (qatomic_load_acquire(&c->state) != NBD_CLIENT_CONNECTED) {
+            continue;
+        }
+        if (qatomic_load_acquire(&best->state) != NBD_CLIENT_CONNECTED ||
+            c->in_flight < best->in_flight)
+        {
+            best = c;
+        }
+    }
+
+    return best;
+}
+
+static int nbd_co_send_request(BDRVNBDState *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int rc, i = -1;
 
     qemu_co_mutex_lock(&s->send_mutex);
-    while (s->in_flight == MAX_NBD_REQUESTS || nbd_client_connecting_wait(s)) {
+    while (s->in_flight == s->max_requests || nbd_client_connecting_wait(s)) {
         qemu_co_queue_wait(&s->free_sema, &s->send_mutex);
     }
 
@@ -804,14 +867,14 @@ static int nbd_co_send_request(BlockDriverState *bs,
 
     s->in_flight++;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->max_requests; i++) {
         if (s->requests[i].coroutine == NULL) {
             break;
         }
     }
 
     g_assert(qemu_in_coroutine());
-    assert(i < MAX_NBD_REQUESTS);
+    assert(i < s->max_requests);
 
     s->requests[i].coroutine = qemu_coroutine_self();
     s->requests[i].offset = request->from;
@@ -1502,7 +1565,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_choose_connection(bs);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -1513,7 +1576,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     }
 
     do {
-        ret = nbd_co_send_request(bs, request, write_qiov);
+        ret = nbd_co_send_request(s, request, write_qiov);
         if (ret < 0) {
             continue;
         }
@@ -1539,7 +1602,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_choose_connection(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -1572,7 +1635,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     }
 
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        ret = nbd_co_send_request(s, &request, NULL);
         if (ret < 0) {
             continue;
         }
@@ -1688,7 +1751,7 @@ static int coroutine_fn nbd_client_co_block_status(
 {
     int ret, request_ret;
     NBDExtent extent = { 0 };
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_choose_connection(bs);
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -1724,7 +1787,7 @@ static int coroutine_fn nbd_client_co_block_status(
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        ret = nbd_co_send_request(s, &request, NULL);
         if (ret < 0) {
             continue;
         }
@@ -1769,31 +1832,28 @@ static int nbd_client_reopen_prepare(BDRVReopenState *state,
 
 static void nbd_yank(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = opaque;
 
     qatomic_store_release(&s->state, NBD_CLIENT_QUIT);
     qio_channel_shutdown(QIO_CHANNEL(s->sioc), QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
 }
 
-static void nbd_client_close(BlockDriverState *bs)
+static void nbd_client_close(BDRVNBDState *s)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
 
     if (s->ioc) {
         nbd_send_request(s->ioc, &request);
     }
 
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
-static int nbd_establish_connection(BlockDriverState *bs,
+static int nbd_establish_connection(BDRVNBDState *s,
                                     SocketAddress *saddr,
                                     Error **errp)
 {
     ERRP_GUARD();
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     s->sioc = qio_channel_socket_new();
     qio_channel_set_name(QIO_CHANNEL(s->sioc), "nbd-client");
@@ -1805,16 +1865,17 @@ static int nbd_establish_connection(BlockDriverState *bs,
         return -1;
     }
 
-    yank_register_function(BLOCKDEV_YANK_INSTANCE(bs->node_name), nbd_yank, bs);
+    yank_register_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
+                           nbd_yank, s);
     qio_channel_set_delay(QIO_CHANNEL(s->sioc), false);
 
     return 0;
 }
 
 /* nbd_client_handshake takes ownership on s->sioc. On failure it's unref'ed. */
-static int nbd_client_handshake(BlockDriverState *bs, Error **errp)
+static int nbd_client_handshake(BDRVNBDState *s, Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BlockDriverState *bs = s->bs;
     AioContext *aio_context = bdrv_get_aio_context(bs);
     int ret;
 
@@ -1833,7 +1894,7 @@ static int nbd_client_handshake(BlockDriverState *bs, Error **errp)
     g_free(s->info.name);
     if (ret < 0) {
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(bs->node_name),
-                                 nbd_yank, bs);
+                                 nbd_yank, s);
         object_unref(OBJECT(s->sioc));
         s->sioc = NULL;
         return ret;
@@ -1886,7 +1947,7 @@ static int nbd_client_handshake(BlockDriverState *bs, Error **errp)
         nbd_send_request(s->ioc ?: QIO_CHANNEL(s->sioc), &request);
 
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(bs->node_name),
-                                 nbd_yank, bs);
+                                 nbd_yank, s);
         object_unref(OBJECT(s->sioc));
         s->sioc = NULL;
 
@@ -2208,6 +2269,18 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to spread requests over if the "
+                    "server allows it. Default 1",
+        },
+        {
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight on each connection."
+                    " Default 16",
+        },
         { /* end of list */ }
     },
 };
@@ -2217,6 +2290,7 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 {
     BDRVNBDState *s = bs->opaque;
     QemuOpts *opts;
+    uint64_t multi_conn, queue_depth;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -2264,6 +2338,23 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (multi_conn < 1 || multi_conn > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        goto error;
+    }
+    s->multi_conn = multi_conn;
+
+    queue_depth = qemu_opt_get_number(opts, "queue-depth",
+                                      NBD_DEFAULT_QUEUE_DEPTH);
+    if (queue_depth < 1 || queue_depth > NBD_MAX_QUEUE_DEPTH) {
+        error_setg(errp, "queue-depth must be between 1 and %d",
+                   NBD_MAX_QUEUE_DEPTH);
+        goto error;
+    }
+    s->max_requests = queue_depth;
+
     ret = 0;
 
  error:
@@ -2274,10 +2365,86 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+static void nbd_start_connection(BDRVNBDState *s)
+{
+    s->state = NBD_CLIENT_CONNECTED;
+
+    nbd_init_connect_thread(s);
+
+    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
+    bdrv_inc_in_flight(s->bs);
+    aio_co_schedule(bdrv_get_aio_context(s->bs), s->connection_co);
+}
+
+/*
+ * Open one more connection to the export for multi-conn and add it to
+ * s->conns. The new connection must see the same export as the first one.
+ */
+static int nbd_open_extra_connection(BDRVNBDState *s, Error **errp)
+{
+    BDRVNBDState *c = g_new0(BDRVNBDState, 1);
+    int ret;
+
+    c->bs = s->bs;
+    c->max_requests = s->max_requests;
+    c->requests = g_new0(NBDClientRequest, c->max_requests);
+    c->reconnect_delay = s->reconnect_delay;
+    c->saddr = s->saddr;
+    c->export = s->export;
+    c->tlscreds = s->tlscreds;
+    c->hostname = s->hostname;
+    c->x_dirty_bitmap = s->x_dirty_bitmap;
+    qemu_co_mutex_init(&c->send_mutex);
+    qemu_co_queue_init(&c->free_sema);
+
+    if (nbd_establish_connection(c, c->saddr, errp) < 0) {
+        ret = -ECONNREFUSED;
+        goto fail;
+    }
+
+    ret = nbd_client_handshake(c, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    nbd_start_connection(c);
+    s->conns[s->nb_conns++] = c;
+
+    if (c->info.size != s->info.size || c->info.flags != s->info.flags) {
+        error_setg(errp, "NBD server reported a different export on another "
+                   "connection");
+        return -EINVAL;
+    }
+
+    return 0;
+
+fail:
+    g_free(c->requests);
+    g_free(c);
+    return ret;
+}
+
+/* Disconnect from the server and free all but the first connection */
+static void nbd_close_connections(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = s->nb_conns - 1; i > 0; i--) {
+        nbd_client_close(s->conns[i]);
+        g_free(s->conns[i]->requests);
+        g_free(s->conns[i]);
+    }
+    nbd_client_close(s);
+
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nb_conns = 0;
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
-    int ret;
+    int i, ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     ret = nbd_process_options(bs, options, errp);
@@ -2293,29 +2460,48 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         return -EEXIST;
     }
 
+    s->requests = g_new0(NBDClientRequest, s->max_requests);
+
     /*
      * establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    if (nbd_establish_connection(bs, s->saddr, errp) < 0) {
+    if (nbd_establish_connection(s, s->saddr, errp) < 0) {
         yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
+        nbd_clear_bdrvstate(s);
         return -ECONNREFUSED;
     }
 
-    ret = nbd_client_handshake(bs, errp);
+    ret = nbd_client_handshake(s, errp);
     if (ret < 0) {
         yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
         nbd_clear_bdrvstate(s);
         return ret;
     }
     /* successfully connected */
-    s->state = NBD_CLIENT_CONNECTED;
+    s->conns = g_new0(BDRVNBDState *, s->multi_conn);
+    s->conns[0] = s;
+    s->nb_conns = 1;
+    nbd_start_connection(s);
 
-    nbd_init_connect_thread(s);
+    /*
+     * Requests may only be spread over several connections if the server
+     * guarantees that a flush on one of them covers writes on all others.
+     * Otherwise stay with the single connection.
+     */
+    if (!(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        return 0;
+    }
 
-    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
-    bdrv_inc_in_flight(bs);
-    aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
+    for (i = 1; i < s->multi_conn; i++) {
+        ret = nbd_open_extra_connection(s, errp);
+        if (ret < 0) {
+            nbd_close_connections(s);
+            yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
+            nbd_clear_bdrvstate(s);
+            return ret;
+        }
+    }
 
     return 0;
 }
@@ -2363,7 +2549,7 @@ static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    nbd_client_close(bs);
+    nbd_close_connections(s);
     yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
     nbd_clear_bdrvstate(s);
 }
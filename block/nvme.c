@@ -135,6 +135,7 @@ struct BDRVNVMeState {
         uint64_t completion_errors;
         uint64_t aligned_accesses;
         uint64_t unaligned_accesses;
+        uint64_t temporary_mappings;
     } stats;
 };
 
@@ -992,13 +993,14 @@ static int nvme_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz)
     return 0;
 }
 
-/* Called with s->dma_map_lock */
+/* Releases the temporary mappings of a qiov mapped by nvme_cmd_map_qiov() */
 static coroutine_fn int nvme_cmd_unmap_qiov(BlockDriverState *bs,
                                             QEMUIOVector *qiov)
 {
     int r = 0;
     BDRVNVMeState *s = bs->opaque;
 
+    qemu_co_mutex_lock(&s->dma_map_lock);
     s->dma_map_count -= qiov->size;
     if (!s->dma_map_count && !qemu_co_queue_empty(&s->dma_flush_queue)) {
         r = qemu_vfio_dma_reset_temporary(s->vfio);
@@ -1006,21 +1008,47 @@ static coroutine_fn int nvme_cmd_unmap_qiov(BlockDriverState *bs,
             qemu_co_queue_restart_all(&s->dma_flush_queue);
         }
     }
+    qemu_co_mutex_unlock(&s->dma_map_lock);
     return r;
 }
 
-/* Called with s->dma_map_lock */
-static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
-                                          NVMeRequest *req, QEMUIOVector *qiov)
+/*
+ * Fill @pagelist from the persistent mappings, which cover guest RAM and
+ * registered buffers.  Returns the number of entries, or -ENOENT if part of
+ * @qiov is not persistently mapped.
+ */
+static int nvme_lookup_qiov(BDRVNVMeState *s, uint64_t *pagelist,
+                            QEMUIOVector *qiov)
+{
+    int i, j;
+    int entries = 0;
+
+    for (i = 0; i < qiov->niov; ++i) {
+        uint64_t iova;
+
+        if (!qemu_vfio_dma_lookup(s->vfio, qiov->iov[i].iov_base,
+                                  qiov->iov[i].iov_len, &iova)) {
+            return -ENOENT;
+        }
+        for (j = 0; j < qiov->iov[i].iov_len / s->page_size; j++) {
+            pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
+        }
+    }
+    return entries;
+}
+
+/*
+ * Map the parts of @qiov that are not persistently mapped with temporary
+ * IOVAs.  Returns the number of entries filled in @pagelist, or -errno.
+ */
+static coroutine_fn int nvme_map_qiov_temporary(BDRVNVMeState *s,
+                                                uint64_t *pagelist,
+                                                QEMUIOVector *qiov)
 {
-    BDRVNVMeState *s = bs->opaque;
-    uint64_t *pagelist = req->prp_list_page;
     int i, j, r;
     int entries = 0;
 
-    assert(qiov->size);
-    assert(QEMU_IS_ALIGNED(qiov->size, s->page_size));
-    assert(qiov->size / s->page_size <= s->page_size / sizeof(uint64_t));
+    qemu_co_mutex_lock(&s->dma_map_lock);
     for (i = 0; i < qiov->niov; ++i) {
         bool retry = true;
         uint64_t iova;
@@ -1056,6 +1084,46 @@ try_map:
     }
 
     s->dma_map_count += qiov->size;
+    qemu_co_mutex_unlock(&s->dma_map_lock);
+    return entries;
+
+fail:
+    qemu_co_mutex_unlock(&s->dma_map_lock);
+    /* No need to unmap [0 - i) iovs even if we've failed, since we don't
+     * increment s->dma_map_count. This is okay for fixed mapping memory areas
+     * because they are already mapped before calling this function; for
+     * temporary mappings, a later nvme_cmd_(un)map_qiov will reclaim by
+     * calling qemu_vfio_dma_reset_temporary when necessary. */
+    return r;
+}
+
+/*
+ * Fill the PRPs of @cmd for @qiov.  If any part of @qiov is outside the
+ * persistent mappings, @temporary is set and the caller must release the
+ * mappings with nvme_cmd_unmap_qiov() when the command completes.
+ */
+static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
+                                          NVMeRequest *req, QEMUIOVector *qiov,
+                                          bool *temporary)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t *pagelist = req->prp_list_page;
+    int i, entries;
+
+    assert(qiov->size);
+    assert(QEMU_IS_ALIGNED(qiov->size, s->page_size));
+    assert(qiov->size / s->page_size <= s->page_size / sizeof(uint64_t));
+
+    *temporary = false;
+    entries = nvme_lookup_qiov(s, pagelist, qiov);
+    if (entries < 0) {
+        s->stats.temporary_mappings++;
+        entries = nvme_map_qiov_temporary(s, pagelist, qiov);
+        if (entries < 0) {
+            return entries;
+        }
+        *temporary = true;
+    }
 
     assert(entries <= s->page_size / sizeof(uint64_t));
     switch (entries) {
@@ -1079,13 +1147,6 @@ try_map:
         trace_nvme_cmd_map_qiov_pages(s, i, pagelist[i]);
     }
     return 0;
-fail:
-    /* No need to unmap [0 - i) iovs even if we've failed, since we don't
-     * increment s->dma_map_count. This is okay for fixed mapping memory areas
-     * because they are already mapped before calling this function; for
-     * temporary mappings, a later nvme_cmd_(un)map_qiov will reclaim by
-     * calling qemu_vfio_dma_reset_temporary when necessary. */
-    return r;
 }
 
 typedef struct {
@@ -1121,6 +1182,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
     NVMeRequest *req;
+    bool temporary;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -1141,9 +1203,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     req = nvme_get_free_req(ioq);
     assert(req);
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
+    r = nvme_cmd_map_qiov(bs, &cmd, req, qiov, &temporary);
     if (r) {
         nvme_put_free_req_and_wake(ioq, req);
         return r;
@@ -1155,11 +1215,11 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         qemu_coroutine_yield();
     }
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_unmap_qiov(bs, qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
-    if (r) {
-        return r;
+    if (temporary) {
+        r = nvme_cmd_unmap_qiov(bs, qiov);
+        if (r) {
+            return r;
+        }
     }
 
     trace_nvme_rw_done(s, is_write, offset, bytes, data.ret);
@@ -1325,6 +1385,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
+    bool temporary;
     int ret;
 
     NvmeCmd cmd = {
@@ -1360,9 +1421,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     req = nvme_get_free_req(ioq);
     assert(req);
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    ret = nvme_cmd_map_qiov(bs, &cmd, req, &local_qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
+    ret = nvme_cmd_map_qiov(bs, &cmd, req, &local_qiov, &temporary);
 
     if (ret) {
         nvme_put_free_req_and_wake(ioq, req);
@@ -1378,12 +1437,11 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
         qemu_coroutine_yield();
     }
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    ret = nvme_cmd_unmap_qiov(bs, &local_qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
-
-    if (ret) {
-        goto out;
+    if (temporary) {
+        ret = nvme_cmd_unmap_qiov(bs, &local_qiov);
+        if (ret) {
+            goto out;
+        }
     }
 
     ret = data.ret;
@@ -1527,6 +1585,7 @@ static BlockStatsSpecific *nvme_get_specific_stats(BlockDriverState *bs)
         .completion_errors = s->stats.completion_errors,
         .aligned_accesses = s->stats.aligned_accesses,
         .unaligned_accesses = s->stats.unaligned_accesses,
+        .temporary_mappings = s->stats.temporary_mappings,
     };
 
     return stats;
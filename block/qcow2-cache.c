@@ -42,6 +42,13 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Maps the offset of every cached table to its Qcow2CachedTable */
+    GHashTable             *index;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -69,6 +76,32 @@ static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
     }
 }
 
+/*
+ * The index is keyed by a pointer to the offset field of the entry itself, so
+ * entries must be removed from it before their offset changes and added back
+ * once the new offset is in place.
+ */
+static void qcow2_cache_index_remove(Qcow2Cache *c, int i)
+{
+    if (c->entries[i].offset != 0) {
+        g_hash_table_remove(c->index, &c->entries[i].offset);
+    }
+}
+
+static void qcow2_cache_index_insert(Qcow2Cache *c, int i)
+{
+    assert(c->entries[i].offset != 0);
+    g_hash_table_insert(c->index, &c->entries[i].offset, &c->entries[i]);
+}
+
+static Qcow2CachedTable *qcow2_cache_index_lookup(Qcow2Cache *c,
+                                                  uint64_t offset)
+{
+    int64_t key = offset;
+
+    return g_hash_table_lookup(c->index, &key);
+}
+
 static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 {
 /* Using MADV_DONTNEED to discard memory is a Linux-specific feature */
@@ -104,6 +137,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
+            qcow2_cache_index_remove(c, i);
             c->entries[i].offset = 0;
             c->entries[i].lru_counter = 0;
             i++;
@@ -133,11 +167,13 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->size = num_tables;
     c->table_size = table_size;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->index = g_hash_table_new(g_int64_hash, g_int64_equal);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
     if (!c->entries || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_hash_table_destroy(c->index);
         g_free(c->entries);
         g_free(c);
         c = NULL;
@@ -155,6 +191,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_hash_table_destroy(c->index);
     g_free(c->entries);
     g_free(c);
 
@@ -303,6 +340,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         return ret;
     }
 
+    g_hash_table_remove_all(c->index);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
@@ -320,9 +358,9 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
     uint64_t min_lru_counter = UINT64_MAX;
     int min_lru_index = -1;
 
@@ -339,20 +377,22 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
+    t = qcow2_cache_index_lookup(c, offset);
+    if (t) {
+        i = t - c->entries;
+        c->hits++;
+        goto found;
+    }
+
+    /* Only a miss needs to look at every entry, to find the LRU victim */
+    c->misses++;
+    for (i = 0; i < c->size; i++) {
+        t = &c->entries[i];
         if (t->ref == 0 && t->lru_counter < min_lru_counter) {
             min_lru_counter = t->lru_counter;
             min_lru_index = i;
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    }
 
     if (min_lru_index == -1) {
         /* This can't happen in current synchronous code, but leave the check
@@ -372,6 +412,10 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
+    if (c->entries[i].offset != 0) {
+        c->evictions++;
+        qcow2_cache_index_remove(c, i);
+    }
     c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
@@ -387,6 +431,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_index_insert(c, i);
 
     /* And return the right table */
 found:
@@ -434,14 +479,9 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    Qcow2CachedTable *t = qcow2_cache_index_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return t ? qcow2_cache_get_table_addr(c, t - c->entries) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
@@ -450,9 +490,21 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
+    qcow2_cache_index_remove(c, i);
     c->entries[i].offset = 0;
     c->entries[i].lru_counter = 0;
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c)
+{
+    Qcow2CacheStats *stats = g_new0(Qcow2CacheStats, 1);
+
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+
+    return stats;
+}
@@ -1581,6 +1581,19 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
+    if (s->alloc_reservation || s->nb_reserved_clusters) {
+        uint64_t nb_reserved = *nb_clusters;
+        int64_t cluster_offset =
+            qcow2_alloc_reserved_clusters(bs, *host_offset, &nb_reserved);
+        if (cluster_offset < 0) {
+            return cluster_offset;
+        } else if (cluster_offset > 0) {
+            *host_offset = cluster_offset;
+            *nb_clusters = nb_reserved;
+            return 0;
+        }
+    }
+
     if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
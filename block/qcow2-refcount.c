@@ -28,6 +28,7 @@
 #include "qemu/range.h"
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
+#include "block/aio_task.h"
 #include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
@@ -1026,6 +1027,74 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
     return offset;
 }
 
+/*
+ * Takes up to *nb_clusters host clusters from the allocation reservation and
+ * sets *nb_clusters to the number of clusters taken. If @offset is not
+ * INV_OFFSET, the clusters must start at @offset. Otherwise an empty
+ * reservation is refilled first with a single refcount update covering
+ * s->alloc_reservation clusters.
+ *
+ * Returns the host offset of the first cluster, 0 if the reservation cannot
+ * serve the request (the caller must then allocate clusters normally), or
+ * -errno if refilling the reservation failed.
+ */
+int64_t qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t offset,
+                                      uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t ret;
+
+    if (offset != INV_OFFSET) {
+        if (s->nb_reserved_clusters == 0 || offset != s->reserved_offset) {
+            return 0;
+        }
+    } else if (s->nb_reserved_clusters == 0) {
+        uint64_t refill = MAX(*nb_clusters, s->alloc_reservation);
+
+        if (s->alloc_reservation == 0) {
+            return 0;
+        }
+
+        ret = qcow2_alloc_clusters(bs, refill << s->cluster_bits);
+        if (ret < 0) {
+            return ret;
+        }
+        trace_qcow2_alloc_reservation_refill(qemu_coroutine_self(), ret,
+                                             refill);
+        s->reserved_offset = ret;
+        s->nb_reserved_clusters = refill;
+    }
+
+    ret = s->reserved_offset;
+    *nb_clusters = MIN(*nb_clusters, s->nb_reserved_clusters);
+    s->reserved_offset += *nb_clusters << s->cluster_bits;
+    s->nb_reserved_clusters -= *nb_clusters;
+
+    return ret;
+}
+
+/*
+ * Drops the references held by the allocation reservation. This must be done
+ * before anything that needs all allocated clusters to be referenced, such as
+ * writing the image out for good or checking its refcounts.
+ */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->nb_reserved_clusters == 0) {
+        return;
+    }
+
+    trace_qcow2_alloc_reservation_release(qemu_coroutine_self(),
+                                          s->reserved_offset,
+                                          s->nb_reserved_clusters);
+    qcow2_free_clusters(bs, s->reserved_offset,
+                        s->nb_reserved_clusters << s->cluster_bits,
+                        QCOW2_DISCARD_NEVER);
+    s->nb_reserved_clusters = 0;
+}
+
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters)
 {
@@ -1587,10 +1656,71 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/* Amount of L2 tables that check_refcounts_l1() reads ahead */
+#define CHECK_L2_READAHEAD_BYTES (16 * MiB)
+
+typedef struct CheckL2ReadTask {
+    AioTask task;
+    BlockDriverState *bs;
+    int64_t offset;
+    void *buf;
+} CheckL2ReadTask;
+
+static coroutine_fn int check_l2_read_task_entry(AioTask *task)
+{
+    CheckL2ReadTask *t = container_of(task, CheckL2ReadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+
+    return bdrv_co_pread(t->bs->file, t->offset, s->cluster_size, t->buf, 0);
+}
+
+/*
+ * Reads the @nb_tables L2 tables at @l2_offsets into @l2_tables, one after
+ * the other. In coroutine context, up to QCOW2_MAX_WORKERS tables are read
+ * in parallel.
+ */
+static int check_read_l2_tables(BlockDriverState *bs, const uint64_t *l2_offsets,
+                                int nb_tables, uint8_t *l2_tables)
+{
+    BDRVQcow2State *s = bs->opaque;
+    AioTaskPool *aio;
+    int i, ret;
+
+    if (!qemu_in_coroutine()) {
+        for (i = 0; i < nb_tables; i++) {
+            ret = bdrv_pread(bs->file, l2_offsets[i],
+                             l2_tables + (size_t) i * s->cluster_size,
+                             s->cluster_size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    for (i = 0; i < nb_tables && aio_task_pool_status(aio) == 0; i++) {
+        CheckL2ReadTask *t = g_new(CheckL2ReadTask, 1);
+
+        *t = (CheckL2ReadTask) {
+            .task.func = check_l2_read_task_entry,
+            .bs = bs,
+            .offset = l2_offsets[i],
+            .buf = l2_tables + (size_t) i * s->cluster_size,
+        };
+        aio_task_pool_start_task(aio, &t->task);
+    }
+    aio_task_pool_wait_all(aio);
+    ret = aio_task_pool_status(aio);
+    aio_task_pool_free(aio);
+
+    return ret;
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which the caller has read from @l2_offset into
+ * @l2_table. While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1598,23 +1728,13 @@ enum {
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
+                              uint64_t *l2_table,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * l2_entry_size(s);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -1647,7 +1767,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 l2_entry & QCOW2_COMPRESSED_SECTOR_MASK,
                 nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1702,7 +1822,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             res->check_errors++;
                             /* Something is seriously wrong, so abort checking
                              * this L2 table */
-                            goto fail;
+                            return ret;
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
@@ -1743,7 +1863,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                                                refcount_table_size,
                                                offset, s->cluster_size);
                 if (ret < 0) {
-                    goto fail;
+                    return ret;
                 }
             }
             break;
@@ -1758,12 +1878,60 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
+}
 
-fail:
-    g_free(l2_table);
-    return ret;
+/*
+ * Reads the @nb_tables L2 tables at @l2_offsets and checks them in order.
+ * @l2_tables must have room for all of them.
+ */
+static int check_refcounts_l2_batch(BlockDriverState *bs, BdrvCheckResult *res,
+                                    void **refcount_table,
+                                    int64_t *refcount_table_size,
+                                    const uint64_t *l2_offsets, int nb_tables,
+                                    uint8_t *l2_tables,
+                                    int flags, BdrvCheckMode fix, bool active)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i, ret;
+
+    ret = check_read_l2_tables(bs, l2_offsets, nb_tables, l2_tables);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+        res->check_errors++;
+        return ret;
+    }
+
+    for (i = 0; i < nb_tables; i++) {
+        uint64_t l2_offset = l2_offsets[i];
+
+        /* Mark L2 table as used */
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       l2_offset, s->cluster_size);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* L2 tables are cluster aligned */
+        if (offset_into_cluster(s, l2_offset)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
+        }
+
+        /* Process and check L2 entries */
+        ret = check_refcounts_l2(bs, res, refcount_table,
+                                 refcount_table_size, l2_offset,
+                                 (uint64_t *)(l2_tables +
+                                              (size_t) i * s->cluster_size),
+                                 flags, fix, active);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
 }
 
 /*
@@ -1783,7 +1951,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    uint64_t *l2_offsets = NULL;
+    uint8_t *l2_tables = NULL;
+    int i, ret, nb_l2, max_l2;
 
     l1_size2 = l1_size * L1E_SIZE;
 
@@ -1812,39 +1982,45 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            ret = qcow2_inc_refcounts_imrt(bs, res,
-                                           refcount_table, refcount_table_size,
-                                           l2_offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
-            }
+    /*
+     * Do the actual checks. The L2 tables are read in batches, so that the
+     * reads can be issued in parallel, and then checked one by one in L1
+     * order.
+     */
+    max_l2 = MAX(1, MIN(l1_size, CHECK_L2_READAHEAD_BYTES / s->cluster_size));
+    if (l1_size > 0) {
+        l2_offsets = g_new(uint64_t, max_l2);
+        l2_tables = g_try_malloc((size_t) max_l2 * s->cluster_size);
+        if (l2_tables == NULL) {
+            ret = -ENOMEM;
+            res->check_errors++;
+            goto fail;
+        }
+    }
 
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+    nb_l2 = 0;
+    for (i = 0; i < l1_size; i++) {
+        l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+        if (l1_table[i]) {
+            l2_offsets[nb_l2++] = l2_offset;
+        }
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags,
-                                     fix, active);
+        if (nb_l2 == max_l2 || (nb_l2 > 0 && i == l1_size - 1)) {
+            ret = check_refcounts_l2_batch(bs, res, refcount_table,
+                                           refcount_table_size, l2_offsets,
+                                           nb_l2, l2_tables, flags, fix,
+                                           active);
             if (ret < 0) {
                 goto fail;
             }
+            nb_l2 = 0;
         }
     }
-    g_free(l1_table);
-    return 0;
+    ret = 0;
 
 fail:
+    g_free(l2_tables);
+    g_free(l2_offsets);
     g_free(l1_table);
     return ret;
 }
@@ -611,6 +611,9 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
     memset(result, 0, sizeof(*result));
 
+    /* Reserved clusters would otherwise show up as leaks */
+    qcow2_release_reserved_clusters(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -697,6 +700,8 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_ALLOC_RESERVATION,
+    QCOW2_OPT_MAX_THREADS,
     NULL
 };
 
@@ -808,6 +813,18 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_RESERVATION,
+            .type = QEMU_OPT_SIZE,
+            .help = "Reserve host clusters for data allocations in chunks "
+                    "of this size",
+        },
+        {
+            .name = QCOW2_OPT_MAX_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of compression and encryption jobs "
+                    "that run in parallel",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -966,6 +983,8 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t alloc_reservation; /* In clusters */
+    uint64_t max_threads;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1070,6 +1089,24 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->alloc_reservation =
+        DIV_ROUND_UP(qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_RESERVATION, 0),
+                     s->cluster_size);
+    if (r->alloc_reservation > INT_MAX >> s->cluster_bits) {
+        error_setg(errp, "Allocation reservation too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->max_threads = qemu_opt_get_number(opts, QCOW2_OPT_MAX_THREADS,
+                                         QCOW2_MAX_THREADS);
+    if (r->max_threads < 1 || r->max_threads > QCOW2_MAX_POOL_THREADS) {
+        error_setg(errp, "max-threads must be between 1 and %d",
+                   QCOW2_MAX_POOL_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1209,6 +1246,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->alloc_reservation = r->alloc_reservation;
+    s->max_threads = r->max_threads;
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -1943,6 +1982,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             goto fail;
         }
 
+        qcow2_release_reserved_clusters(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2660,6 +2701,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_reserved_clusters(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -4171,6 +4214,9 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
 
     if (offset < old_length) {
         int64_t last_cluster, old_file_size;
+
+        /* Shrinking the image file must not cut off reserved clusters */
+        qcow2_release_reserved_clusters(bs);
         if (prealloc != PREALLOC_MODE_OFF) {
             error_setg(errp,
                        "Preallocation can't be used for shrinking an image");
@@ -4835,6 +4881,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    qcow2_release_reserved_clusters(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
@@ -5058,6 +5106,25 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats;
+
+    /* The caches are recreated by qcow2_co_invalidate_cache() */
+    if (!s->l2_table_cache || !s->refcount_block_cache) {
+        return NULL;
+    }
+
+    stats = g_new(BlockStatsSpecific, 1);
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2.l2_cache = qcow2_cache_get_stats(s->l2_table_cache);
+    stats->u.qcow2.refcount_cache =
+        qcow2_cache_get_stats(s->refcount_block_cache);
+
+    return stats;
+}
+
 static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
                                                   Error **errp)
 {
@@ -5430,6 +5497,8 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     Qcow2AmendHelperCBInfo helper_cb_info;
     bool encryption_update = false;
 
+    qcow2_release_reserved_clusters(bs);
+
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
             /* only change explicitly defined options */
@@ -5911,6 +5980,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -150,6 +150,8 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_ALLOC_RESERVATION "alloc-reservation"
+#define QCOW2_OPT_MAX_THREADS "max-threads"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -323,6 +325,8 @@ typedef struct Qcow2BitmapHeaderExt {
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
 #define QCOW2_MAX_THREADS 4
+/* Upper limit for the max-threads option, the size of the thread pool */
+#define QCOW2_MAX_POOL_THREADS 64
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -357,6 +361,16 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Host clusters whose refcount has been increased in advance but that are
+     * not referenced by anything yet. Data cluster allocations are served
+     * from here, so that their refcounts are updated in batches of
+     * @alloc_reservation clusters rather than one allocation at a time.
+     */
+    uint64_t alloc_reservation;
+    uint64_t reserved_offset;
+    uint64_t nb_reserved_clusters;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -408,6 +422,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
 
     BdrvChild *data_file;
 
@@ -864,6 +879,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t offset,
+                                      uint64_t *nb_clusters);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -973,6 +991,7 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -37,6 +37,7 @@
 #include "sysemu/replay.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-timers.h"
+#include "sysemu/sev.h"
 #include "trace.h"
 
 #include "hw/i386/x86.h"
@@ -772,6 +773,9 @@ void x86_load_linux(X86MachineState *x86ms,
     char *vmode;
     MachineState *machine = MACHINE(x86ms);
     struct setup_data *setup_data;
+    GMappedFile *kernel_mapped_file;
+    GError *kernel_gerr = NULL;
+    SevKernelLoaderContext sev_load_ctx = {};
     const char *kernel_filename = machine->kernel_filename;
     const char *initrd_filename = machine->initrd_filename;
     const char *dtb_filename = machine->dtb;
@@ -1006,6 +1010,9 @@ void x86_load_linux(X86MachineState *x86ms,
 
         stl_p(header + 0x218, initrd_addr);
         stl_p(header + 0x21c, initrd_size);
+
+        sev_load_ctx.initrd_data = initrd_data;
+        sev_load_ctx.initrd_size = initrd_size;
     }
 
     /* load kernel and setup */
@@ -1020,18 +1027,32 @@ void x86_load_linux(X86MachineState *x86ms,
     }
     kernel_size -= setup_size;
 
-    setup  = g_malloc(setup_size);
-    kernel = g_malloc(kernel_size);
-    fseek(f, 0, SEEK_SET);
-    if (fread(setup, 1, setup_size, f) != setup_size) {
-        fprintf(stderr, "fread() failed\n");
+    fclose(f);
+
+    /*
+     * Map the kernel rather than reading it into a heap buffer: fw_cfg only
+     * ever reads it, and the mapping stays alive for the lifetime of the
+     * machine just like the initrd one.
+     */
+    kernel_mapped_file = g_mapped_file_new(kernel_filename, false,
+                                           &kernel_gerr);
+    if (!kernel_mapped_file) {
+        fprintf(stderr, "qemu: error reading kernel %s: %s\n",
+                kernel_filename, kernel_gerr->message);
         exit(1);
     }
-    if (fread(kernel, 1, kernel_size, f) != kernel_size) {
-        fprintf(stderr, "fread() failed\n");
+    if (g_mapped_file_get_length(kernel_mapped_file) <
+        setup_size + kernel_size) {
+        fprintf(stderr, "qemu: kernel %s was truncated while loading\n",
+                kernel_filename);
         exit(1);
     }
-    fclose(f);
+    x86ms->kernel_mapped_file = kernel_mapped_file;
+
+    setup = g_malloc(setup_size);
+    memcpy(setup, g_mapped_file_get_contents(kernel_mapped_file), setup_size);
+    kernel = (uint8_t *)g_mapped_file_get_contents(kernel_mapped_file) +
+             setup_size;
 
     /* append dtb to kernel */
     if (dtb_filename) {
@@ -1047,7 +1068,9 @@ void x86_load_linux(X86MachineState *x86ms,
             exit(1);
         }
 
+        /* the mapped kernel is read-only, so append to a private copy */
         setup_data_offset = QEMU_ALIGN_UP(kernel_size, 16);
+        kernel = g_memdup(kernel, kernel_size);
         kernel_size = setup_data_offset + sizeof(struct setup_data) + dtb_size;
         kernel = g_realloc(kernel, kernel_size);
 
@@ -1063,6 +1086,19 @@ void x86_load_linux(X86MachineState *x86ms,
 
     memcpy(setup, header, MIN(sizeof(header), setup_size));
 
+    /*
+     * For SEV guests booted with kernel-hashes=on, record the digests of
+     * exactly what is handed to the firmware via fw_cfg so that it can
+     * verify them against the measured hashes table.
+     */
+    sev_load_ctx.setup_data = (char *)setup;
+    sev_load_ctx.setup_size = setup_size;
+    sev_load_ctx.kernel_data = (char *)kernel;
+    sev_load_ctx.kernel_size = kernel_size;
+    sev_load_ctx.cmdline_data = (char *)kernel_cmdline;
+    sev_load_ctx.cmdline_size = strlen(kernel_cmdline) + 1;
+    sev_add_kernel_loader_hashes(&sev_load_ctx, &error_fatal);
+
     fw_cfg_add_i32(fw_cfg, FW_CFG_KERNEL_ADDR, prot_addr);
     fw_cfg_add_i32(fw_cfg, FW_CFG_KERNEL_SIZE, kernel_size);
     fw_cfg_add_bytes(fw_cfg, FW_CFG_KERNEL_DATA, kernel, kernel_size);
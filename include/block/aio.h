@@ -211,6 +211,17 @@ struct AioContext {
      */
     struct LuringState *linux_io_uring;
 
+    /*
+     * Same for the io_uring with IORING_SETUP_IOPOLL, which only supports
+     * O_DIRECT reads and writes.
+     */
+    struct LuringState *linux_io_uring_iopoll;
+
+    /* io_uring SQPOLL parameters, used when linux_io_uring is created */
+    bool io_uring_sqpoll;
+    uint32_t io_uring_sqpoll_idle_ms;
+    int io_uring_sqpoll_cpu;
+
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
@@ -492,6 +503,22 @@ struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+/* Setup the polled completion LuringState bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring_iopoll(AioContext *ctx,
+                                                    Error **errp);
+
+/* Return the polled completion LuringState bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring_iopoll(AioContext *ctx);
+
+/*
+ * Return in @submits and @wakeups how many times requests were submitted
+ * to the io_uring SQPOLL thread of this AioContext, and how many of those
+ * had to wake it up.  Returns false if the AioContext has no io_uring in
+ * SQPOLL mode.
+ */
+bool aio_get_io_uring_sqpoll_stats(AioContext *ctx, uint64_t *submits,
+                                   uint64_t *wakeups);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -727,4 +754,20 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @sqpoll: whether requests are submitted by a kernel polling thread
+ * @sqpoll_idle_ms: how long the polling thread spins before it sleeps, in
+ *                  milliseconds, 0 for the kernel default
+ * @sqpoll_cpu: host CPU the polling thread is bound to, or -1
+ *
+ * The parameters take effect when the io_uring instance of @ctx is created,
+ * so they cannot be changed once it is in use.  With @sqpoll the instance is
+ * created right away, and an error is returned if the kernel refuses it.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     uint32_t sqpoll_idle_ms, int sqpoll_cpu,
+                                     Error **errp);
+
 #endif
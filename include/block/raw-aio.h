@@ -60,10 +60,16 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s);
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
 typedef struct LuringState LuringState;
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(bool iopoll, bool sqpoll, uint32_t sqpoll_idle_ms,
+                         int sqpoll_cpu, Error **errp);
+bool luring_get_sqpoll_stats(LuringState *s, uint64_t *submits,
+                             uint64_t *wakeups);
 void luring_cleanup(LuringState *s);
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
-                                uint64_t offset, QEMUIOVector *qiov, int type);
+                                  int fixed_file, uint64_t offset,
+                                  QEMUIOVector *qiov, int type);
+int luring_register_file(LuringState *s, int fd);
+void luring_unregister_file(LuringState *s, int index);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 void luring_io_plug(BlockDriverState *bs, LuringState *s);
@@ -59,6 +59,13 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * Number of pages reported dirty by the accelerator's dirty log
+     * while the dirty rate is being measured.  Protected by iothread
+     * lock.
+     */
+    uint64_t dirty_rate_pages;
 };
 #endif
 #endif
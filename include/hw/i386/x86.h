@@ -51,6 +51,7 @@ struct X86MachineState {
     FWCfgState *fw_cfg;
     qemu_irq *gsi;
     DeviceState *ioapic2;
+    GMappedFile *kernel_mapped_file;
     GMappedFile *initrd_mapped_file;
     HotplugHandler *acpi_dev;
 
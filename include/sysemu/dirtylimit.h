@@ -0,0 +1,28 @@
+/*
+ * Per-vCPU dirty page rate limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_DIRTYLIMIT_H
+#define SYSEMU_DIRTYLIMIT_H
+
+#include "qapi/qapi-types-migration.h"
+
+/**
+ * dirtylimit_in_service:
+ *
+ * Returns: %true if a dirty page rate limit is set on any vCPU.
+ */
+bool dirtylimit_in_service(void);
+
+/**
+ * dirtylimit_query_all:
+ *
+ * Returns: the limit and throttling state of every vCPU that has a dirty
+ * page rate limit, or %NULL if there is none.
+ */
+DirtyLimitInfoList *dirtylimit_query_all(void);
+
+#endif
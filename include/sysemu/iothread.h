@@ -37,6 +37,11 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* io_uring parameters */
+    bool io_uring_sqpoll;
+    uint32_t io_uring_sqpoll_idle;
+    int32_t io_uring_sqpoll_cpu;
 };
 typedef struct IOThread IOThread;
 
@@ -222,6 +222,23 @@ int kvm_has_many_ioeventfds(void);
 int kvm_has_gsi_routing(void);
 int kvm_has_intx_set_mask(void);
 
+/**
+ * kvm_dirty_ring_enabled:
+ *
+ * Returns: true if dirty pages are tracked with the per-vCPU dirty
+ * rings, which attribute each dirty page to the vCPU that dirtied it
+ * (see CPUState::dirty_pages).
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_reap_all:
+ *
+ * Collect the pending dirty pages of all the vCPU dirty rings.  Must be
+ * called with the iothread lock held.
+ */
+void kvm_dirty_ring_reap_all(void);
+
 /**
  * kvm_arm_supports_user_irq
  *
@@ -113,6 +113,7 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->io_uring_sqpoll_cpu = -1;
     iothread->thread_id = -1;
     qemu_sem_init(&iothread->init_done_sem, 0);
     /* By default, we don't run gcontext */
@@ -190,6 +191,18 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    aio_context_set_io_uring_params(iothread->ctx,
+                                    iothread->io_uring_sqpoll,
+                                    iothread->io_uring_sqpoll_idle,
+                                    iothread->io_uring_sqpoll_cpu,
+                                    &local_error);
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     /* This assumes we are called from a thread with useful CPU affinity for us
      * to inherit.
      */
@@ -259,6 +272,71 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static bool iothread_get_io_uring_sqpoll(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->io_uring_sqpoll;
+}
+
+static void iothread_set_io_uring_sqpoll(Object *obj, bool value,
+                                         Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        error_setg(errp, "io-uring-sqpoll cannot be changed at run-time");
+        return;
+    }
+    iothread->io_uring_sqpoll = value;
+}
+
+static void iothread_get_io_uring_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int64_t value;
+
+    if (!strcmp(name, "io-uring-sqpoll-idle")) {
+        value = iothread->io_uring_sqpoll_idle;
+    } else {
+        value = iothread->io_uring_sqpoll_cpu;
+    }
+    visit_type_int64(v, name, &value, errp);
+}
+
+static void iothread_set_io_uring_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int64_t value;
+
+    if (iothread->ctx) {
+        error_setg(errp, "%s cannot be changed at run-time", name);
+        return;
+    }
+
+    if (!visit_type_int64(v, name, &value, errp)) {
+        return;
+    }
+
+    if (!strcmp(name, "io-uring-sqpoll-idle")) {
+        if (value < 0 || value > UINT32_MAX) {
+            error_setg(errp, "%s value must be in range [0, %" PRIu32 "]",
+                       name, UINT32_MAX);
+            return;
+        }
+        iothread->io_uring_sqpoll_idle = value;
+    } else {
+        if (value < -1 || value > INT32_MAX) {
+            error_setg(errp, "%s value must be -1 or in range [0, %" PRId32
+                       "]", name, INT32_MAX);
+            return;
+        }
+        iothread->io_uring_sqpoll_cpu = value;
+    }
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -276,6 +354,17 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add_bool(klass, "io-uring-sqpoll",
+                                   iothread_get_io_uring_sqpoll,
+                                   iothread_set_io_uring_sqpoll);
+    object_class_property_add(klass, "io-uring-sqpoll-idle", "int",
+                              iothread_get_io_uring_param,
+                              iothread_set_io_uring_param,
+                              NULL, NULL);
+    object_class_property_add(klass, "io-uring-sqpoll-cpu", "int",
+                              iothread_get_io_uring_param,
+                              iothread_set_io_uring_param,
+                              NULL, NULL);
 }
 
 static const TypeInfo iothread_info = {
@@ -325,6 +414,13 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    if (iothread->ctx &&
+        aio_get_io_uring_sqpoll_stats(iothread->ctx,
+                                      &info->io_uring_sqpoll_submits,
+                                      &info->io_uring_sqpoll_wakeups)) {
+        info->has_io_uring_sqpoll_submits = true;
+        info->has_io_uring_sqpoll_wakeups = true;
+    }
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
@@ -15,8 +15,14 @@
 #include "qapi/error.h"
 #include "cpu.h"
 #include "exec/ramblock.h"
+#include "exec/memory.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/main-loop.h"
 #include "qapi/qapi-commands-migration.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-visit-migration.h"
+#include "sysemu/kvm.h"
+#include "hw/boards.h"
 #include "ram.h"
 #include "trace.h"
 #include "dirtyrate.h"
@@ -67,18 +73,30 @@ static struct DirtyRateInfo *query_dirty_rate_info(void)
     if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED) {
         info->has_dirty_rate = true;
         info->dirty_rate = dirty_rate;
+        if (DirtyStat.ramblock_rates) {
+            info->has_ramblock_dirty_rate = true;
+            info->ramblock_dirty_rate = QAPI_CLONE(DirtyRateRAMBlockInfoList,
+                                                   DirtyStat.ramblock_rates);
+        }
+        if (DirtyStat.vcpu_rates) {
+            info->has_vcpu_dirty_rate = true;
+            info->vcpu_dirty_rate = QAPI_CLONE(DirtyRateVcpuList,
+                                               DirtyStat.vcpu_rates);
+        }
     }
 
     info->status = CalculatingState;
     info->start_time = DirtyStat.start_time;
     info->calc_time = DirtyStat.calc_time;
+    info->mode = DirtyStat.mode;
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
 
     return info;
 }
 
-static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time)
+static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time,
+                                DirtyRateMeasureMode mode)
 {
     DirtyStat.total_dirty_samples = 0;
     DirtyStat.total_sample_count = 0;
@@ -86,6 +104,11 @@ static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time)
     DirtyStat.dirty_rate = -1;
     DirtyStat.start_time = start_time;
     DirtyStat.calc_time = calc_time;
+    DirtyStat.mode = mode;
+    qapi_free_DirtyRateRAMBlockInfoList(DirtyStat.ramblock_rates);
+    DirtyStat.ramblock_rates = NULL;
+    qapi_free_DirtyRateVcpuList(DirtyStat.vcpu_rates);
+    DirtyStat.vcpu_rates = NULL;
 }
 
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
@@ -355,6 +378,151 @@ out:
     rcu_unregister_thread();
 }
 
+/* dirty rate in MB/s of @pages target pages dirtied in @msec */
+static int64_t dirty_pages_to_rate(uint64_t pages, int64_t msec)
+{
+    return ((pages * TARGET_PAGE_SIZE * 1000) / msec) >> 20;
+}
+
+/*
+ * Discard what the dirty log reported so far, and write protect the
+ * guest memory again when KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE is in use,
+ * so that only the pages dirtied from now on are counted.
+ *
+ * Called with iothread lock and RCU read lock held.
+ */
+static void dirtyrate_reset_dirty_log(void)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        block->dirty_rate_pages = 0;
+        memory_region_clear_dirty_bitmap(block->mr, 0, block->used_length);
+    }
+}
+
+/* Called with iothread lock and RCU read lock held. */
+static void record_ramblock_dirty_rate(int64_t msec)
+{
+    RAMBlock *block;
+    uint64_t total_dirty_pages = 0;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        DirtyRateRAMBlockInfo *info = g_new0(DirtyRateRAMBlockInfo, 1);
+
+        info->idstr = g_strdup(block->idstr);
+        info->dirty_rate = dirty_pages_to_rate(block->dirty_rate_pages, msec);
+        QAPI_LIST_PREPEND(DirtyStat.ramblock_rates, info);
+
+        trace_record_ramblock_dirty_rate(block->idstr,
+                                         block->dirty_rate_pages);
+        total_dirty_pages += block->dirty_rate_pages;
+    }
+
+    DirtyStat.dirty_rate = dirty_pages_to_rate(total_dirty_pages, msec);
+}
+
+/*
+ * The dirty ring attributes each dirty page to the vCPU that dirtied it.
+ * Return the CPUState::dirty_pages of every possible vCPU, or NULL if the
+ * dirty ring is not in use.
+ *
+ * Called with iothread lock held, after syncing the dirty log.
+ */
+static uint64_t *dirtyrate_vcpu_pages(void)
+{
+    int max_cpus = current_machine->smp.max_cpus;
+    uint64_t *pages;
+    CPUState *cpu;
+
+    if (!kvm_dirty_ring_enabled()) {
+        return NULL;
+    }
+
+    pages = g_new0(uint64_t, max_cpus);
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < max_cpus) {
+            pages[cpu->cpu_index] = cpu->dirty_pages;
+        }
+    }
+    return pages;
+}
+
+/* Called with iothread lock held, after syncing the dirty log. */
+static void record_vcpu_dirty_rate(const uint64_t *start_pages, int64_t msec)
+{
+    int max_cpus = current_machine->smp.max_cpus;
+    g_autofree uint64_t *end_pages = dirtyrate_vcpu_pages();
+    int i;
+
+    if (!start_pages || !end_pages) {
+        return;
+    }
+
+    for (i = max_cpus - 1; i >= 0; i--) {
+        DirtyRateVcpu *info;
+        uint64_t pages;
+
+        /* the vCPU is not plugged */
+        if (!qemu_get_cpu(i)) {
+            continue;
+        }
+
+        pages = end_pages[i] - start_pages[i];
+        info = g_new0(DirtyRateVcpu, 1);
+        info->id = i;
+        info->dirty_rate = dirty_pages_to_rate(pages, msec);
+        QAPI_LIST_PREPEND(DirtyStat.vcpu_rates, info);
+
+        trace_record_vcpu_dirty_rate(i, pages);
+    }
+}
+
+/*
+ * Count the pages that the accelerator reports dirty in its dirty log,
+ * which gives exact per-RAMBlock numbers instead of an estimate based
+ * on a sample of the pages.  With the KVM dirty ring the pages are also
+ * counted per vCPU.
+ */
+static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
+{
+    g_autofree uint64_t *vcpu_pages = NULL;
+    int64_t msec;
+    int64_t initial_time;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+    /*
+     * The first sync may report all the pages dirty, e.g. with
+     * KVM_DIRTY_LOG_INITIALLY_SET, so start counting after it.
+     */
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        dirtyrate_reset_dirty_log();
+    }
+    vcpu_pages = dirtyrate_vcpu_pages();
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+    DirtyStat.start_time = initial_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        record_ramblock_dirty_rate(msec);
+    }
+    record_vcpu_dirty_rate(vcpu_pages, msec);
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+}
+
 void *get_dirtyrate_thread(void *arg)
 {
     struct DirtyRateConfig config = *(struct DirtyRateConfig *)arg;
@@ -371,9 +539,13 @@ void *get_dirtyrate_thread(void *arg)
 
     start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
     calc_time = config.sample_period_seconds;
-    init_dirtyrate_stat(start_time, calc_time);
+    init_dirtyrate_stat(start_time, calc_time, config.mode);
 
-    calculate_dirtyrate(config);
+    if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        calculate_dirtyrate_dirty_bitmap(config);
+    } else {
+        calculate_dirtyrate(config);
+    }
 
     ret = dirtyrate_set_state(&CalculatingState, DIRTY_RATE_STATUS_MEASURING,
                               DIRTY_RATE_STATUS_MEASURED);
@@ -383,7 +555,8 @@ void *get_dirtyrate_thread(void *arg)
     return NULL;
 }
 
-void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
 {
     static struct DirtyRateConfig config;
     QemuThread thread;
@@ -404,6 +577,15 @@ void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
         return;
     }
 
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP && !kvm_enabled()) {
+        error_setg(errp, "dirty-bitmap mode is only supported with KVM.");
+        return;
+    }
+
     /*
      * Init calculation state as unstarted.
      */
@@ -416,6 +598,7 @@ void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
 
     config.sample_period_seconds = calc_time;
     config.sample_pages_per_gigabytes = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    config.mode = mode;
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
 }
@@ -13,6 +13,8 @@
 #ifndef QEMU_MIGRATION_DIRTYRATE_H
 #define QEMU_MIGRATION_DIRTYRATE_H
 
+#include "qapi/qapi-types-migration.h"
+
 /*
  * Sample 512 pages per GB as default.
  * TODO: Make it configurable.
@@ -38,6 +40,7 @@
 struct DirtyRateConfig {
     uint64_t sample_pages_per_gigabytes; /* sample pages per GB */
     int64_t sample_period_seconds; /* time duration between two sampling */
+    DirtyRateMeasureMode mode; /* mechanism to measure dirty rate */
 };
 
 /*
@@ -63,6 +66,9 @@ struct DirtyRateStat {
     int64_t dirty_rate; /* dirty rate in MB/s */
     int64_t start_time; /* calculation start time in units of second */
     int64_t calc_time; /* time duration of two sampling in units of second */
+    DirtyRateMeasureMode mode; /* mechanism used for the measurement */
+    DirtyRateRAMBlockInfoList *ramblock_rates; /* per-RAMBlock dirty rates */
+    DirtyRateVcpuList *vcpu_rates; /* per-vCPU dirty rates */
 };
 
 void *get_dirtyrate_thread(void *arg);
@@ -0,0 +1,112 @@
+/*
+ * Multifd lz4 packet stream
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "multifd-lz4-stream.h"
+
+/*
+ * Level 0 is the "fast" tier: plain lz4 trading compression ratio for
+ * speed.  Level 1 is plain lz4 with its default settings, and higher
+ * levels use the lz4hc compressor, whose output is decoded by the same
+ * lz4 decompressor.
+ */
+#define MULTIFD_LZ4_FAST_ACCELERATION 8
+
+MultiFDLz4Stream *multifd_lz4_stream_new(int level, uint32_t packet_size)
+{
+    MultiFDLz4Stream *z = g_new0(MultiFDLz4Stream, 1);
+    bool ok;
+
+    z->level = level;
+    z->packet_size = packet_size;
+    if (level > 1) {
+        z->stream_hc = LZ4_createStreamHC();
+        if (z->stream_hc) {
+            LZ4_setCompressionLevel(z->stream_hc, level);
+        }
+        ok = z->stream_hc != NULL;
+    } else if (level >= 0) {
+        z->stream = LZ4_createStream();
+        ok = z->stream != NULL;
+    } else {
+        z->stream_decode = LZ4_createStreamDecode();
+        ok = z->stream_decode != NULL;
+    }
+    z->pbuff[0] = g_try_malloc(packet_size);
+    z->pbuff[1] = g_try_malloc(packet_size);
+    z->zbuff_len = LZ4_compressBound(packet_size);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!ok || !z->pbuff[0] || !z->pbuff[1] || !z->zbuff) {
+        multifd_lz4_stream_free(z);
+        return NULL;
+    }
+    return z;
+}
+
+void multifd_lz4_stream_free(MultiFDLz4Stream *z)
+{
+    if (z->stream) {
+        LZ4_freeStream(z->stream);
+    }
+    if (z->stream_hc) {
+        LZ4_freeStreamHC(z->stream_hc);
+    }
+    if (z->stream_decode) {
+        LZ4_freeStreamDecode(z->stream_decode);
+    }
+    g_free(z->pbuff[0]);
+    g_free(z->pbuff[1]);
+    g_free(z->zbuff);
+    g_free(z);
+}
+
+uint32_t multifd_lz4_stream_compress(MultiFDLz4Stream *z,
+                                     const struct iovec *iov,
+                                     unsigned int iovcnt, size_t size)
+{
+    uint8_t *in = z->pbuff[z->cur];
+    size_t in_size;
+    int ret;
+
+    assert(z->level >= 0 && size <= z->packet_size);
+    in_size = iov_to_buf(iov, iovcnt, 0, in, size);
+    if (z->level > 1) {
+        ret = LZ4_compress_HC_continue(z->stream_hc, (char *)in,
+                                       (char *)z->zbuff, in_size,
+                                       z->zbuff_len);
+    } else {
+        ret = LZ4_compress_fast_continue(z->stream, (char *)in,
+                                         (char *)z->zbuff, in_size,
+                                         z->zbuff_len,
+                                         z->level ?
+                                         1 : MULTIFD_LZ4_FAST_ACCELERATION);
+    }
+    /* keep this packet in place, the next one refers to it */
+    z->cur ^= 1;
+
+    return ret > 0 ? ret : 0;
+}
+
+int multifd_lz4_stream_decompress(MultiFDLz4Stream *z, uint32_t in_size,
+                                  const struct iovec *iov,
+                                  unsigned int iovcnt, size_t size)
+{
+    uint8_t *out = z->pbuff[z->cur];
+    int ret;
+
+    assert(z->level < 0 && size <= z->packet_size && in_size <= z->zbuff_len);
+    ret = LZ4_decompress_safe_continue(z->stream_decode, (char *)z->zbuff,
+                                       (char *)out, in_size, size);
+    if (ret < 0 || ret != size) {
+        return -1;
+    }
+    z->cur ^= 1;
+
+    iov_from_buf(iov, iovcnt, 0, out, size);
+    return 0;
+}
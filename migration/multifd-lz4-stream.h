@@ -0,0 +1,65 @@
+/*
+ * Multifd lz4 packet stream
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_MULTIFD_LZ4_STREAM_H
+#define QEMU_MIGRATION_MULTIFD_LZ4_STREAM_H
+
+#include <lz4.h>
+#include <lz4hc.h>
+
+/*
+ * The packets of a channel form a single lz4 stream, so that matches can
+ * refer back to the previous packet.  Both sides must see the packets in
+ * the same order, which multifd guarantees within a channel.
+ */
+typedef struct MultiFDLz4Stream {
+    /* compression level, see migrate_multifd_lz4_level(); -1 to decode */
+    int level;
+    LZ4_stream_t *stream;
+    LZ4_streamHC_t *stream_hc;
+    LZ4_streamDecode_t *stream_decode;
+    /*
+     * Contiguous copies of the pages, used in turn.  lz4 reads back its
+     * input while compressing, so it can't work directly on guest pages
+     * that may be changing under its feet; and the previous packet must
+     * stay in place while the next one refers to it.
+     */
+    uint8_t *pbuff[2];
+    int cur;
+    /* size of each pbuff */
+    uint32_t packet_size;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+} MultiFDLz4Stream;
+
+/*
+ * Create a stream compressing at @level, or decompressing if @level is
+ * negative.  Returns NULL if out of memory.
+ */
+MultiFDLz4Stream *multifd_lz4_stream_new(int level, uint32_t packet_size);
+void multifd_lz4_stream_free(MultiFDLz4Stream *z);
+
+/*
+ * Compress the @size bytes of @iov into z->zbuff.
+ * Returns the compressed size, or 0 on error.
+ */
+uint32_t multifd_lz4_stream_compress(MultiFDLz4Stream *z,
+                                     const struct iovec *iov,
+                                     unsigned int iovcnt, size_t size);
+
+/*
+ * Decompress the @in_size bytes in z->zbuff into the @size bytes of @iov.
+ * Returns 0 on success, or -1 if the input does not decompress to exactly
+ * @size bytes.
+ */
+int multifd_lz4_stream_decompress(MultiFDLz4Stream *z, uint32_t in_size,
+                                  const struct iovec *iov,
+                                  unsigned int iovcnt, size_t size);
+
+#endif
@@ -0,0 +1,441 @@
+/*
+ * Multifd XBZRLE delta encoding implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include "qemu/bswap.h"
+#include "exec/target_page.h"
+#include "exec/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each page in a packet is preceded by one of these tags:
+ * - ZERO: the page is all zeros, no data follows
+ * - SAME: the page didn't change since it was last sent, no data follows
+ * - NORMAL: the full page follows
+ * - XBZRLE: a be32 length follows, then the encoded delta against the
+ *           previous content of the page
+ */
+enum {
+    MULTIFD_XBZRLE_ZERO,
+    MULTIFD_XBZRLE_SAME,
+    MULTIFD_XBZRLE_NORMAL,
+    MULTIFD_XBZRLE_XBZRLE,
+};
+
+#define MULTIFD_XBZRLE_HDR_LEN (1 + sizeof(uint32_t))
+
+struct xbzrle_data {
+    /* cache for the pages sent through this channel */
+    PageCache *cache;
+    /* copy of the page being encoded, the guest can still write to it */
+    uint8_t *current_buf;
+    /* a page full of zeros */
+    uint8_t *zero_page;
+    /* buffer with the encoded packet */
+    uint8_t *buf;
+    /* size of buf */
+    uint32_t buf_len;
+};
+
+/* protects ram_counters and xbzrle_counters updates from the channels */
+static QemuMutex xbzrle_stats_lock;
+
+/* Multifd XBZRLE encoding */
+
+/**
+ * xbzrle_cache_key: address of a page inside its channel cache
+ *
+ * Pages are spread round robin between the channels by
+ * multifd_page_channel(), so each cache only ever sees one page out
+ * of every @channels.  Index the cache by the page number inside the
+ * channel so that all of its slots get used.
+ *
+ * @block: RAMBlock of the page
+ * @offset: offset of the page inside @block
+ */
+static uint64_t xbzrle_cache_key(RAMBlock *block, ram_addr_t offset)
+{
+    uint64_t page = (block->offset + offset) >> qemu_target_page_bits();
+
+    page /= migrate_multifd_channels();
+    return page << qemu_target_page_bits();
+}
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Setup each channel with its share of the XBZRLE cache.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    size_t page_size = qemu_target_page_size();
+    uint64_t cache_size;
+    struct xbzrle_data *x;
+
+    if (migrate_use_compression()) {
+        error_setg(errp, "multifd %d: xbzrle method is not compatible "
+                   "with compress capability", p->id);
+        return -1;
+    }
+
+    /*
+     * migrate_xbzrle_cache_size() is a power of two, but the number
+     * of channels need not be.
+     */
+    cache_size = migrate_xbzrle_cache_size() / migrate_multifd_channels();
+    cache_size = MAX(pow2floor(cache_size), page_size);
+
+    x = g_malloc0(sizeof(struct xbzrle_data));
+    x->cache = cache_init(cache_size, page_size, errp);
+    if (!x->cache) {
+        g_free(x);
+        return -1;
+    }
+    x->current_buf = g_try_malloc(page_size);
+    x->zero_page = g_try_malloc0(page_size);
+    /* Worst case is every page being sent as an encoded delta */
+    x->buf_len = page_count * (MULTIFD_XBZRLE_HDR_LEN + page_size);
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->current_buf || !x->zero_page || !x->buf) {
+        cache_fini(x->cache);
+        g_free(x->current_buf);
+        g_free(x->zero_page);
+        g_free(x->buf);
+        g_free(x);
+        error_setg(errp, "multifd %d: out of memory for xbzrle", p->id);
+        return -1;
+    }
+    trace_multifd_xbzrle_send_setup(p->id, cache_size);
+    p->data = x;
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Free the channel cache and buffers.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    if (!x) {
+        return;
+    }
+    cache_fini(x->cache);
+    g_free(x->current_buf);
+    g_free(x->zero_page);
+    g_free(x->buf);
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Encode every page against the content it had the last time that it
+ * was sent through this channel.  Both the cache and the data put on
+ * the wire come from the same snapshot of the page, so the
+ * destination always ends with exactly what we have cached.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    /* only used for cache replacement, a racy read is good enough */
+    uint64_t age = ram_counters.dirty_sync_count;
+    uint64_t zero = 0, normal = 0, xbzrle = 0, miss = 0, overflow = 0;
+    uint64_t xbzrle_bytes = 0;
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        uint64_t key = xbzrle_cache_key(pages->block, pages->offset[i]);
+        uint8_t *out = x->buf + out_size;
+        uint8_t *prev;
+        int encoded_len;
+
+        memcpy(x->current_buf, pages->iov[i].iov_base, page_size);
+
+        if (buffer_is_zero(x->current_buf, page_size)) {
+            /* Keep a previously cached version from going stale */
+            if (cache_is_cached(x->cache, key, age)) {
+                cache_insert(x->cache, key, x->zero_page, age);
+            }
+            out[0] = MULTIFD_XBZRLE_ZERO;
+            out_size += 1;
+            zero++;
+            continue;
+        }
+
+        if (!cache_is_cached(x->cache, key, age)) {
+            miss++;
+            /* Failing to insert only means the next send is a miss again */
+            cache_insert(x->cache, key, x->current_buf, age);
+            goto normal_page;
+        }
+
+        prev = get_cached_data(x->cache, key);
+        encoded_len = xbzrle_encode_buffer(prev, x->current_buf, page_size,
+                                           out + MULTIFD_XBZRLE_HDR_LEN,
+                                           page_size);
+        if (encoded_len < 0) {
+            overflow++;
+            memcpy(prev, x->current_buf, page_size);
+            goto normal_page;
+        }
+
+        xbzrle++;
+        if (encoded_len == 0) {
+            out[0] = MULTIFD_XBZRLE_SAME;
+            out_size += 1;
+            continue;
+        }
+        memcpy(prev, x->current_buf, page_size);
+        out[0] = MULTIFD_XBZRLE_XBZRLE;
+        stl_be_p(out + 1, encoded_len);
+        out_size += MULTIFD_XBZRLE_HDR_LEN + encoded_len;
+        xbzrle_bytes += MULTIFD_XBZRLE_HDR_LEN + encoded_len;
+        continue;
+
+normal_page:
+        out[0] = MULTIFD_XBZRLE_NORMAL;
+        memcpy(out + 1, x->current_buf, page_size);
+        out_size += 1 + page_size;
+        normal++;
+    }
+
+    /*
+     * The migration thread leaves the accounting of these pages to
+     * us, and the counters are shared between all channels.
+     */
+    qemu_mutex_lock(&xbzrle_stats_lock);
+    ram_counters.normal += normal;
+    ram_counters.duplicate += zero;
+    xbzrle_counters.pages += xbzrle;
+    /* overflowed pages count as xbzrle traffic, as in save_xbzrle_page() */
+    xbzrle_counters.bytes += xbzrle_bytes + overflow * page_size;
+    xbzrle_counters.cache_miss += miss;
+    xbzrle_counters.overflow += overflow;
+    qemu_mutex_unlock(&xbzrle_stats_lock);
+
+    trace_multifd_xbzrle_send_prepare(p->id, used, zero, xbzrle, normal,
+                                      out_size);
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    return 0;
+}
+
+/**
+ * xbzrle_send_write: do the actual write of the data
+ *
+ * Do the actual write of the encoded buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    return qio_channel_write_all(p->c, (void *)x->buf, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the buffer for the encoded packets.  The destination doesn't
+ * need a cache: deltas are applied directly on top of guest memory,
+ * that holds what was last sent for each page.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *x = g_malloc0(sizeof(struct xbzrle_data));
+
+    x->buf_len = page_count * (MULTIFD_XBZRLE_HDR_LEN +
+                               qemu_target_page_size());
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->buf) {
+        g_free(x);
+        error_setg(errp, "multifd %d: out of memory for xbzrle", p->id);
+        return -1;
+    }
+    p->data = x;
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * Free the receive buffer.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *x = p->data;
+
+    if (!x) {
+        return;
+    }
+    g_free(x->buf);
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the encoded buffer, and apply each page record on top of the
+ * guest pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    size_t page_size = qemu_target_page_size();
+    uint32_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > x->buf_len) {
+        error_setg(errp, "multifd %d: packet size received %u maximum %u",
+                   p->id, in_size, x->buf_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)x->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        uint8_t *host = p->pages->iov[i].iov_base;
+        uint32_t len;
+
+        if (pos >= in_size) {
+            goto truncated;
+        }
+        switch (x->buf[pos++]) {
+        case MULTIFD_XBZRLE_ZERO:
+            /* Don't touch pages that are already zero */
+            if (!buffer_is_zero(host, page_size)) {
+                memset(host, 0, page_size);
+            }
+            break;
+        case MULTIFD_XBZRLE_SAME:
+            break;
+        case MULTIFD_XBZRLE_NORMAL:
+            if (in_size - pos < page_size) {
+                goto truncated;
+            }
+            memcpy(host, x->buf + pos, page_size);
+            pos += page_size;
+            break;
+        case MULTIFD_XBZRLE_XBZRLE:
+            if (in_size - pos < sizeof(uint32_t)) {
+                goto truncated;
+            }
+            len = ldl_be_p(x->buf + pos);
+            pos += sizeof(uint32_t);
+            if (len > page_size || in_size - pos < len) {
+                goto truncated;
+            }
+            if (xbzrle_decode_buffer(x->buf + pos, len, host,
+                                     page_size) == -1) {
+                error_setg(errp, "multifd %d: failed to decode xbzrle page "
+                           "at offset " RAM_ADDR_FMT " of block %s", p->id,
+                           p->pages->offset[i], p->pages->block->idstr);
+                return -1;
+            }
+            pos += len;
+            break;
+        default:
+            error_setg(errp, "multifd %d: unknown xbzrle page tag %d",
+                       p->id, x->buf[pos - 1]);
+            return -1;
+        }
+    }
+    if (pos != in_size) {
+        error_setg(errp, "multifd %d: packet size received %u size used %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %d: xbzrle packet truncated at page %u",
+               p->id, i);
+    return -1;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .send_write = xbzrle_send_write,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages,
+    .pin_pages = true,
+    .handles_zero_pages = true,
+};
+
+static void multifd_xbzrle_register(void)
+{
+    qemu_mutex_init(&xbzrle_stats_lock);
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
@@ -12,6 +12,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "qemu/bitops.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -262,6 +264,20 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
+static uint32_t multifd_zero_bitmap_len(uint32_t page_count)
+{
+    return DIV_ROUND_UP(page_count, BITS_PER_BYTE);
+}
+
+/*
+ * Zero page detection is done by the channels with multifd-zero-page,
+ * unless the method has its own way of dealing with them.
+ */
+static bool multifd_use_zero_page(MultiFDMethods *ops)
+{
+    return migrate_multifd_zero_page() && !ops->handles_zero_pages;
+}
+
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
@@ -272,6 +288,12 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(p->zero_pages);
+
+    if (p->flags & MULTIFD_FLAG_ZERO_PAGE) {
+        memcpy(&packet->offset[p->pages->allocated], p->zero_bitmap,
+               multifd_zero_bitmap_len(p->pages->allocated));
+    }
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -341,6 +363,28 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
+    if (!!(p->flags & MULTIFD_FLAG_ZERO_PAGE) != !!p->zero_bitmap) {
+        error_setg(errp, "multifd: multifd-zero-page must be set on both "
+                   "source and destination");
+        return -1;
+    }
+    if (p->zero_bitmap) {
+        if (packet->pages_alloc != pages_max) {
+            error_setg(errp, "multifd: received packet with %d pages and "
+                       "zero page bitmap for %d pages",
+                       packet->pages_alloc, pages_max);
+            return -1;
+        }
+        p->zero_pages = be32_to_cpu(packet->zero_pages);
+        if (p->zero_pages > p->pages->used) {
+            error_setg(errp, "multifd: received packet with %d zero pages "
+                       "out of %d pages", p->zero_pages, p->pages->used);
+            return -1;
+        }
+        memcpy(p->zero_bitmap, &packet->offset[pages_max],
+               multifd_zero_bitmap_len(pages_max));
+    }
+
     if (p->pages->used == 0) {
         return 0;
     }
@@ -363,9 +407,11 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
+        p->pages->offset[i] = offset;
         p->pages->iov[i].iov_base = block->host + offset;
         p->pages->iov[i].iov_len = qemu_target_page_size();
     }
+    p->pages->block = block;
 
     return 0;
 }
@@ -386,6 +432,10 @@ struct {
     int exiting;
     /* multifd ops */
     MultiFDMethods *ops;
+    /* per channel array of pages to send, only used for ops->pin_pages */
+    MultiFDPages_t **channel_pages;
+    /* zero pages are detected by the channels */
+    bool zero_page;
 } *multifd_send_state;
 
 /*
@@ -406,13 +456,64 @@ struct {
  * false.
  */
 
+/*
+ * The migration thread accounted all queued pages as normal ones, fix
+ * that up for the zero pages that channel @p found since last time.
+ * Called with @p locked, or after its thread has finished.
+ */
+static void multifd_send_account_zero_pages(QEMUFile *f, MultiFDSendParams *p)
+{
+    uint64_t zero = p->zero_pages_pending;
+    uint64_t bytes = zero * qemu_target_page_size();
+
+    if (!zero) {
+        return;
+    }
+    if (f) {
+        qemu_file_update_transfer(f, -(int64_t)bytes);
+    }
+    ram_counters.multifd_bytes -= bytes;
+    ram_counters.transferred -= bytes;
+    ram_counters.normal -= zero;
+    ram_counters.duplicate += zero;
+    ram_counters.multifd_zero_pages += zero;
+    p->zero_pages_pending = 0;
+}
+
+/*
+ * Hand @pagesp over to channel @p, which must be locked and have its
+ * pending_job already accounted, and give the channel's empty pages
+ * back in exchange.
+ */
+static int multifd_send_pages_locked(QEMUFile *f, MultiFDSendParams *p,
+                                     MultiFDPages_t **pagesp)
+{
+    MultiFDPages_t *pages = *pagesp;
+    uint64_t transferred;
+
+    assert(!p->pages->used);
+    assert(!p->pages->block);
+
+    multifd_send_account_zero_pages(f, p);
+    p->packet_num = multifd_send_state->packet_num++;
+    *pagesp = p->pages;
+    p->pages = pages;
+    transferred = ((uint64_t) pages->used) * qemu_target_page_size()
+                + p->packet_len;
+    qemu_file_update_transfer(f, transferred);
+    ram_counters.multifd_bytes += transferred;
+    ram_counters.transferred += transferred;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 1;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     if (qatomic_read(&multifd_send_state->exiting)) {
         return -1;
@@ -441,19 +542,76 @@ static int multifd_send_pages(QEMUFile *f)
         }
         qemu_mutex_unlock(&p->mutex);
     }
-    assert(!p->pages->used);
-    assert(!p->pages->block);
 
-    p->packet_num = multifd_send_state->packet_num++;
-    multifd_send_state->pages = p->pages;
-    p->pages = pages;
-    transferred = ((uint64_t) pages->used) * qemu_target_page_size()
-                + p->packet_len;
-    qemu_file_update_transfer(f, transferred);
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;
-    qemu_mutex_unlock(&p->mutex);
-    qemu_sem_post(&p->sem);
+    return multifd_send_pages_locked(f, p, &multifd_send_state->pages);
+}
+
+/*
+ * Methods that keep per page state in the channels (ops->pin_pages)
+ * need every page to be sent through the same channel, otherwise the
+ * state would be split between channels and packets for the same page
+ * could be reordered on the destination.  Consecutive pages are spread
+ * round robin so that dirtying a range still keeps all channels busy.
+ */
+int multifd_page_channel(RAMBlock *block, ram_addr_t offset)
+{
+    uint64_t page = (block->offset + offset) >> qemu_target_page_bits();
+
+    return page % migrate_multifd_channels();
+}
+
+/*
+ * Like multifd_send_pages(), but for the per channel pages of channel
+ * @id.  We need to wait for that precise channel to be free.
+ */
+static int multifd_send_channel_pages(QEMUFile *f, int id)
+{
+    MultiFDSendParams *p = &multifd_send_state->params[id];
+
+    qemu_mutex_lock(&p->mutex);
+    while (p->pending_job && !p->quit &&
+           !qatomic_read(&multifd_send_state->exiting)) {
+        qemu_cond_wait(&p->job_done, &p->mutex);
+    }
+    if (qatomic_read(&multifd_send_state->exiting)) {
+        qemu_mutex_unlock(&p->mutex);
+        return -1;
+    }
+    if (p->quit) {
+        error_report("%s: channel %d has already quit!", __func__, id);
+        qemu_mutex_unlock(&p->mutex);
+        return -1;
+    }
+    p->pending_job++;
+
+    return multifd_send_pages_locked(f, p,
+                                     &multifd_send_state->channel_pages[id]);
+}
+
+static int multifd_queue_channel_page(QEMUFile *f, RAMBlock *block,
+                                      ram_addr_t offset)
+{
+    int id = multifd_page_channel(block, offset);
+    MultiFDPages_t *pages = multifd_send_state->channel_pages[id];
+
+    if (pages->block && pages->block != block) {
+        if (multifd_send_channel_pages(f, id) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->channel_pages[id];
+    }
+
+    pages->block = block;
+    pages->offset[pages->used] = offset;
+    pages->iov[pages->used].iov_base = block->host + offset;
+    pages->iov[pages->used].iov_len = qemu_target_page_size();
+    pages->used++;
+
+    if (pages->used == pages->allocated) {
+        if (multifd_send_channel_pages(f, id) < 0) {
+            return -1;
+        }
+    }
 
     return 1;
 }
@@ -462,6 +620,10 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
 {
     MultiFDPages_t *pages = multifd_send_state->pages;
 
+    if (multifd_send_state->channel_pages) {
+        return multifd_queue_channel_page(f, block, offset);
+    }
+
     if (!pages->block) {
         pages->block = block;
     }
@@ -521,6 +683,7 @@ static void multifd_send_terminate_threads(Error *err)
 
         qemu_mutex_lock(&p->mutex);
         p->quit = true;
+        qemu_cond_broadcast(&p->job_done);
         qemu_sem_post(&p->sem);
         qemu_mutex_unlock(&p->mutex);
     }
@@ -545,9 +708,12 @@ void multifd_save_cleanup(void)
         MultiFDSendParams *p = &multifd_send_state->params[i];
         Error *local_err = NULL;
 
+        multifd_send_account_zero_pages(NULL, p);
+
         socket_send_channel_destroy(p->c);
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->job_done);
         qemu_sem_destroy(&p->sem);
         qemu_sem_destroy(&p->sem_sync);
         g_free(p->name);
@@ -559,6 +725,10 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->zero_bitmap);
+        p->zero_bitmap = NULL;
+        g_free(p->zero_offset);
+        p->zero_offset = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -570,6 +740,13 @@ void multifd_save_cleanup(void)
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
     multifd_send_state->pages = NULL;
+    if (multifd_send_state->channel_pages) {
+        for (i = 0; i < migrate_multifd_channels(); i++) {
+            multifd_pages_clear(multifd_send_state->channel_pages[i]);
+        }
+        g_free(multifd_send_state->channel_pages);
+        multifd_send_state->channel_pages = NULL;
+    }
     g_free(multifd_send_state);
     multifd_send_state = NULL;
 }
@@ -587,6 +764,17 @@ void multifd_send_sync_main(QEMUFile *f)
             return;
         }
     }
+    if (multifd_send_state->channel_pages) {
+        for (i = 0; i < migrate_multifd_channels(); i++) {
+            if (!multifd_send_state->channel_pages[i]->used) {
+                continue;
+            }
+            if (multifd_send_channel_pages(f, i) < 0) {
+                error_report("%s: multifd_send_channel_pages fail", __func__);
+                return;
+            }
+        }
+    }
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
@@ -600,6 +788,7 @@ void multifd_send_sync_main(QEMUFile *f)
             return;
         }
 
+        multifd_send_account_zero_pages(f, p);
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
@@ -618,6 +807,42 @@ void multifd_send_sync_main(QEMUFile *f)
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * Find the zero pages of the packet.  Those are moved after the normal
+ * ones, so that methods only have to deal with the first pages.
+ *
+ * Returns the number of normal pages
+ */
+static uint32_t multifd_send_zero_pages(MultiFDSendParams *p, uint32_t used)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t normal = 0, zero = 0;
+    uint32_t i;
+
+    memset(p->zero_bitmap, 0, multifd_zero_bitmap_len(pages->allocated));
+    for (i = 0; i < used; i++) {
+        if (buffer_is_zero(pages->iov[i].iov_base, pages->iov[i].iov_len)) {
+            p->zero_offset[zero++] = pages->offset[i];
+            continue;
+        }
+        pages->offset[normal] = pages->offset[i];
+        pages->iov[normal] = pages->iov[i];
+        normal++;
+    }
+    for (i = 0; i < zero; i++) {
+        uint32_t page = normal + i;
+
+        pages->offset[page] = p->zero_offset[i];
+        pages->iov[page].iov_base = pages->block->host + p->zero_offset[i];
+        pages->iov[page].iov_len = qemu_target_page_size();
+        p->zero_bitmap[page / BITS_PER_BYTE] |= 1 << (page % BITS_PER_BYTE);
+    }
+    p->zero_pages = zero;
+    p->zero_pages_pending += zero;
+
+    return normal;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -645,16 +870,24 @@ static void *multifd_send_thread(void *opaque)
 
         if (p->pending_job) {
             uint32_t used = p->pages->used;
+            uint32_t normal = used;
             uint64_t packet_num = p->packet_num;
+
+            if (multifd_send_state->zero_page) {
+                p->flags |= MULTIFD_FLAG_ZERO_PAGE;
+                normal = multifd_send_zero_pages(p, used);
+            }
             flags = p->flags;
 
-            if (used) {
-                ret = multifd_send_state->ops->send_prepare(p, used,
+            if (normal) {
+                ret = multifd_send_state->ops->send_prepare(p, normal,
                                                             &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
                     break;
                 }
+            } else {
+                p->next_packet_size = 0;
             }
             multifd_send_fill_packet(p);
             p->flags = 0;
@@ -673,8 +906,9 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
-            if (used) {
-                ret = multifd_send_state->ops->send_write(p, used, &local_err);
+            if (normal) {
+                ret = multifd_send_state->ops->send_write(p, normal,
+                                                          &local_err);
                 if (ret != 0) {
                     break;
                 }
@@ -682,12 +916,19 @@ static void *multifd_send_thread(void *opaque)
 
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
+            qemu_cond_signal(&p->job_done);
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
                 qemu_sem_post(&p->sem_sync);
             }
-            qemu_sem_post(&multifd_send_state->channels_ready);
+            /*
+             * With pinned pages the migration thread waits for this
+             * precise channel on job_done, and channels_ready is unused.
+             */
+            if (!multifd_send_state->ops->pin_pages) {
+                qemu_sem_post(&multifd_send_state->channels_ready);
+            }
         } else if (p->quit) {
             qemu_mutex_unlock(&p->mutex);
             break;
@@ -715,6 +956,7 @@ out:
 
     qemu_mutex_lock(&p->mutex);
     p->running = false;
+    qemu_cond_broadcast(&p->job_done);
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
@@ -826,7 +1068,10 @@ static void multifd_new_send_channel_cleanup(MultiFDSendParams *p,
       * thread neet to judge whether it is running, so we need to mark
       * its status.
       */
+     qemu_mutex_lock(&p->mutex);
      p->quit = true;
+     qemu_cond_broadcast(&p->job_done);
+     qemu_mutex_unlock(&p->mutex);
      object_unref(OBJECT(ioc));
      error_free(err);
 }
@@ -872,11 +1117,22 @@ int multifd_save_setup(Error **errp)
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_send_state->zero_page =
+        multifd_use_zero_page(multifd_send_state->ops);
+    if (multifd_send_state->ops->pin_pages) {
+        multifd_send_state->channel_pages = g_new0(MultiFDPages_t *,
+                                                   thread_count);
+        for (i = 0; i < thread_count; i++) {
+            multifd_send_state->channel_pages[i] =
+                multifd_pages_init(page_count);
+        }
+    }
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
         qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->job_done);
         qemu_sem_init(&p->sem, 0);
         qemu_sem_init(&p->sem_sync, 0);
         p->quit = false;
@@ -885,6 +1141,11 @@ int multifd_save_setup(Error **errp)
         p->pages = multifd_pages_init(page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
+        if (multifd_send_state->zero_page) {
+            p->packet_len += multifd_zero_bitmap_len(page_count);
+            p->zero_bitmap = g_malloc0(multifd_zero_bitmap_len(page_count));
+            p->zero_offset = g_new0(ram_addr_t, page_count);
+        }
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
@@ -917,6 +1178,8 @@ struct {
     uint64_t packet_num;
     /* multifd ops */
     MultiFDMethods *ops;
+    /* packets carry a zero page bitmap */
+    bool zero_page;
 } *multifd_recv_state;
 
 static void multifd_recv_terminate_threads(Error *err)
@@ -995,6 +1258,8 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->zero_bitmap);
+        p->zero_bitmap = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -1033,6 +1298,45 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Clear the zero pages of the packet, and move the normal ones first
+ * for the method to receive.
+ *
+ * Returns the number of normal pages, or -1 for error
+ */
+static int multifd_recv_zero_pages(MultiFDRecvParams *p, uint32_t used,
+                                   Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t normal = 0, zero = 0;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        void *host = pages->iov[i].iov_base;
+        size_t len = pages->iov[i].iov_len;
+
+        if (p->zero_bitmap[i / BITS_PER_BYTE] & (1 << (i % BITS_PER_BYTE))) {
+            /* Don't touch (and allocate) pages that are already zero */
+            if (!buffer_is_zero(host, len)) {
+                memset(host, 0, len);
+            }
+            zero++;
+            continue;
+        }
+        pages->offset[normal] = pages->offset[i];
+        pages->iov[normal] = pages->iov[i];
+        normal++;
+    }
+    if (zero != p->zero_pages) {
+        error_setg(errp, "multifd %d: zero page bitmap has %d pages, "
+                   "expected %d", p->id, zero, p->zero_pages);
+        return -1;
+    }
+    p->num_zero_pages += zero;
+
+    return normal;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1076,6 +1380,14 @@ static void *multifd_recv_thread(void *opaque)
         p->num_pages += used;
         qemu_mutex_unlock(&p->mutex);
 
+        if (used && multifd_recv_state->zero_page) {
+            ret = multifd_recv_zero_pages(p, used, &local_err);
+            if (ret < 0) {
+                break;
+            }
+            used = ret;
+        }
+
         if (used) {
             ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
             if (ret != 0) {
@@ -1118,6 +1430,8 @@ int multifd_load_setup(Error **errp)
     qatomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_recv_state->zero_page =
+        multifd_use_zero_page(multifd_recv_state->ops);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1129,6 +1443,10 @@ int multifd_load_setup(Error **errp)
         p->pages = multifd_pages_init(page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
+        if (multifd_recv_state->zero_page) {
+            p->packet_len += multifd_zero_bitmap_len(page_count);
+            p->zero_bitmap = g_malloc0(multifd_zero_bitmap_len(page_count));
+        }
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
@@ -22,6 +22,7 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+int multifd_page_channel(RAMBlock *block, ram_addr_t offset);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,6 +33,11 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
+#define MULTIFD_FLAG_LZ4 (4 << 1)
+
+/* The packet carries a zero page bitmap after the offsets */
+#define MULTIFD_FLAG_ZERO_PAGE (1 << 4)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -46,8 +52,16 @@ typedef struct {
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* number of bits set in the zero page bitmap */
+    uint32_t zero_pages;
+    uint32_t unused32[1];  /* Reserved for future use */
+    uint64_t unused[3];    /* Reserved for future use */
     char ramblock[256];
+    /*
+     * pages_alloc offsets.  With MULTIFD_FLAG_ZERO_PAGE, they are
+     * followed by a bitmap of pages_alloc bits, bit N of byte M being
+     * set when page M * 8 + N is all zeros and has no data sent.
+     */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
@@ -87,6 +101,8 @@ typedef struct {
     bool quit;
     /* thread has work to do */
     int pending_job;
+    /* signalled when pending_job drops or the thread quits */
+    QemuCond job_done;
     /* array of pages to sent */
     MultiFDPages_t *pages;
     /* packet allocated len */
@@ -104,6 +120,14 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* number of zero pages in the current packet */
+    uint32_t zero_pages;
+    /* zero pages found, not yet accounted by the migration thread */
+    uint64_t zero_pages_pending;
+    /* zero pages of the current packet, one bit per page */
+    uint8_t *zero_bitmap;
+    /* scratch space used to move the zero pages at the end */
+    ram_addr_t *zero_offset;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
@@ -143,6 +167,12 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages received through this channel */
+    uint64_t num_zero_pages;
+    /* zero pages of the current packet, one bit per page */
+    uint8_t *zero_bitmap;
+    /* number of zero pages in the current packet */
+    uint32_t zero_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for de-compression methods */
@@ -164,6 +194,13 @@ typedef struct {
     void (*recv_cleanup)(MultiFDRecvParams *p);
     /* Read all pages */
     int (*recv_pages)(MultiFDRecvParams *p, uint32_t used, Error **errp);
+    /*
+     * Each page must always be sent through the same channel, see
+     * multifd_page_channel()
+     */
+    bool pin_pages;
+    /* The method deals with zero pages itself, see multifd-zero-page */
+    bool handles_zero_pages;
 } MultiFDMethods;
 
 void multifd_register_ops(int method, MultiFDMethods *ops);
@@ -907,7 +907,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
         return;
     }
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_xbzrle() || migrate_use_multifd_xbzrle()) {
         double encoded_size, unencoded_size;
 
         xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
@@ -1941,6 +1941,21 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * The xbzrle multifd method keeps its page caches in the channels,
+     * so it needs to see every page, zero ones included, to keep them
+     * coherent with the destination.  The channels account the pages.
+     */
+    if (migrate_use_multifd_xbzrle() && !migration_in_postcopy()) {
+        return multifd_queue_page(rs->f, block, offset) < 0 ? -1 : 1;
+    }
+
+    /* With multifd-zero-page, the channels look for zero pages */
+    if (!save_page_use_compression(rs) && migrate_use_multifd() &&
+        migrate_multifd_zero_page() && !migration_in_postcopy()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2166,7 +2181,7 @@ static void ram_save_cleanup(void *opaque)
         /* caller have hold iothread lock or is in a bh, so there is
          * no writing race against the migration bitmap
          */
-        memory_global_dirty_log_stop();
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -2629,7 +2644,7 @@ static void ram_init_bitmaps(RAMState *rs)
         ram_list_init_bitmaps();
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
-            memory_global_dirty_log_start();
+            memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
             migration_bitmap_sync_precopy(rs);
         }
     }
@@ -3298,6 +3313,269 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
+/*
+ * A RAMBlock range is always written by the same load thread, so that a
+ * page sent again in a later iteration is never overwritten by an older
+ * copy still queued on another thread.
+ */
+#define RAM_LOAD_RANGE_SHIFT 21
+#define RAM_LOAD_BATCH_PAGES 64
+
+typedef struct RamLoadPage {
+    void *host;
+    /* The page is set to @ch instead of copied from the batch data */
+    bool filled;
+    uint8_t ch;
+} RamLoadPage;
+
+typedef struct RamLoadBatch {
+    unsigned int num;
+    RamLoadPage pages[RAM_LOAD_BATCH_PAGES];
+    uint8_t *data;
+} RamLoadBatch;
+
+struct RamLoadParam {
+    bool done;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    QemuThread thread;
+    /* Batch filled by the incoming migration thread */
+    RamLoadBatch *fill;
+    /* Batch handed over to the load thread, NULL once it took it */
+    RamLoadBatch *apply;
+    RamLoadBatch batch[2];
+};
+typedef struct RamLoadParam RamLoadParam;
+
+static RamLoadParam *load_param;
+static int load_thread_count;
+static QemuMutex load_done_lock;
+static QemuCond load_done_cond;
+
+static void ram_load_apply_batch(RamLoadBatch *batch)
+{
+    unsigned int i;
+
+    for (i = 0; i < batch->num; i++) {
+        RamLoadPage *page = &batch->pages[i];
+
+        if (page->filled) {
+            ram_handle_compressed(page->host, page->ch, TARGET_PAGE_SIZE);
+        } else {
+            memcpy(page->host, batch->data + i * TARGET_PAGE_SIZE,
+                   TARGET_PAGE_SIZE);
+        }
+    }
+    batch->num = 0;
+}
+
+static void *do_ram_load(void *opaque)
+{
+    RamLoadParam *param = opaque;
+    RamLoadBatch *batch;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->apply) {
+            batch = param->apply;
+            param->apply = NULL;
+            qemu_mutex_unlock(&param->mutex);
+
+            ram_load_apply_batch(batch);
+
+            qemu_mutex_lock(&load_done_lock);
+            param->done = true;
+            qemu_cond_signal(&load_done_cond);
+            qemu_mutex_unlock(&load_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void ram_load_threads_cleanup(void)
+{
+    int i;
+
+    if (!load_param) {
+        return;
+    }
+
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_lock(&load_param[i].mutex);
+        load_param[i].quit = true;
+        qemu_cond_signal(&load_param[i].cond);
+        qemu_mutex_unlock(&load_param[i].mutex);
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_thread_join(&load_param[i].thread);
+        qemu_mutex_destroy(&load_param[i].mutex);
+        qemu_cond_destroy(&load_param[i].cond);
+        g_free(load_param[i].batch[0].data);
+        g_free(load_param[i].batch[1].data);
+    }
+    qemu_mutex_destroy(&load_done_lock);
+    qemu_cond_destroy(&load_done_cond);
+    g_free(load_param);
+    load_param = NULL;
+    load_thread_count = 0;
+}
+
+static void ram_load_threads_setup(void)
+{
+    int i;
+
+    /* The decompress threads already write the pages in parallel */
+    if (!migrate_load_threads() || migrate_use_compression()) {
+        return;
+    }
+
+    load_thread_count = migrate_load_threads();
+    load_param = g_new0(RamLoadParam, load_thread_count);
+    qemu_mutex_init(&load_done_lock);
+    qemu_cond_init(&load_done_cond);
+    for (i = 0; i < load_thread_count; i++) {
+        RamLoadParam *param = &load_param[i];
+
+        param->batch[0].data = g_malloc(RAM_LOAD_BATCH_PAGES *
+                                        TARGET_PAGE_SIZE);
+        param->batch[1].data = g_malloc(RAM_LOAD_BATCH_PAGES *
+                                        TARGET_PAGE_SIZE);
+        param->fill = &param->batch[0];
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        param->done = true;
+        qemu_thread_create(&param->thread, "ram-load", do_ram_load, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+    trace_ram_load_threads_setup(load_thread_count);
+}
+
+/* COLO keeps a copy of every page as it is loaded, so it loads them inline */
+static bool ram_load_threads_active(void)
+{
+    return load_param && !migration_incoming_colo_enabled();
+}
+
+static RamLoadParam *ram_load_thread_of(void *host)
+{
+    uintptr_t range = (uintptr_t)host >> RAM_LOAD_RANGE_SHIFT;
+
+    return &load_param[range % load_thread_count];
+}
+
+/* Hand the batch being filled over to its load thread */
+static void ram_load_thread_submit(RamLoadParam *param)
+{
+    RamLoadBatch *batch = param->fill;
+
+    if (!batch->num) {
+        return;
+    }
+
+    qemu_mutex_lock(&load_done_lock);
+    while (!param->done) {
+        qemu_cond_wait(&load_done_cond, &load_done_lock);
+    }
+    param->done = false;
+    qemu_mutex_unlock(&load_done_lock);
+
+    qemu_mutex_lock(&param->mutex);
+    param->apply = batch;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    /* The load thread is done with the other batch */
+    param->fill = batch == &param->batch[0] ? &param->batch[1] :
+                                              &param->batch[0];
+}
+
+/* Wait until every page queued on the load thread is in guest memory */
+static void ram_load_thread_wait(RamLoadParam *param)
+{
+    ram_load_thread_submit(param);
+
+    qemu_mutex_lock(&load_done_lock);
+    while (!param->done) {
+        qemu_cond_wait(&load_done_cond, &load_done_lock);
+    }
+    qemu_mutex_unlock(&load_done_lock);
+}
+
+static void wait_for_load_threads_done(void)
+{
+    int i;
+
+    if (!load_param) {
+        return;
+    }
+
+    for (i = 0; i < load_thread_count; i++) {
+        ram_load_thread_submit(&load_param[i]);
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        ram_load_thread_wait(&load_param[i]);
+    }
+}
+
+/*
+ * Queue a page for its load thread: @fill pages are set to @ch, others
+ * are read from @f.
+ */
+static void ram_load_page_with_threads(QEMUFile *f, void *host, bool fill,
+                                       uint8_t ch)
+{
+    RamLoadParam *param = ram_load_thread_of(host);
+    RamLoadBatch *batch = param->fill;
+    RamLoadPage *page = &batch->pages[batch->num];
+
+    page->host = host;
+    page->filled = fill;
+    page->ch = ch;
+    if (!fill) {
+        qemu_get_buffer(f, batch->data + batch->num * TARGET_PAGE_SIZE,
+                        TARGET_PAGE_SIZE);
+    }
+
+    if (++batch->num == RAM_LOAD_BATCH_PAGES) {
+        ram_load_thread_submit(param);
+    }
+}
+
+/*
+ * Fault in a whole RAMBlock with the load threads' parallelism before its
+ * pages arrive, instead of taking one page fault per page on the load
+ * path.  Not done for postcopy, which relies on the pages still being
+ * missing, nor when RAM discards are required (e.g. virtio-mem), where
+ * parts of the block must stay unpopulated.
+ */
+static int ram_load_prealloc(RAMBlock *block, bool postcopy_advised)
+{
+    Error *local_err = NULL;
+
+    if (!ram_load_threads_active() || postcopy_advised ||
+        ramblock_is_ignored(block) || ram_block_discard_is_required()) {
+        return 0;
+    }
+
+    trace_ram_load_prealloc(block->idstr, block->used_length,
+                            load_thread_count);
+    os_mem_prealloc(block->fd, (char *)block->host, block->used_length,
+                    load_thread_count, &local_err);
+    if (local_err) {
+        error_reportf_err(local_err, "Failed to preallocate block %s: ",
+                          block->idstr);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
  /*
   * we must set ram_bulk_stage to false, otherwise in
   * migation_bitmap_find_dirty the bitmap will be unused and
@@ -3372,7 +3650,7 @@ void colo_incoming_start_dirty_log(void)
             /* Discard this dirty bitmap record */
             bitmap_zero(block->bmap, block->max_length >> TARGET_PAGE_BITS);
         }
-        memory_global_dirty_log_start();
+        memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
     }
     ram_state->migration_dirty_pages = 0;
     qemu_mutex_unlock_ramlist();
@@ -3384,7 +3662,7 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
-    memory_global_dirty_log_stop();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
@@ -3415,6 +3693,8 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
         return -1;
     }
 
+    ram_load_threads_setup();
+
     xbzrle_load_setup();
     ramblock_recv_map_init();
 
@@ -3431,6 +3711,7 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    ram_load_threads_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
@@ -3832,6 +4113,9 @@ static int ram_load_precopy(QEMUFile *f)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret) {
+                        ret = ram_load_prealloc(block, postcopy_advised);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -3844,10 +4128,18 @@ static int ram_load_precopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_ZERO:
             ch = qemu_get_byte(f);
+            if (ram_load_threads_active()) {
+                ram_load_page_with_threads(f, host, true, ch);
+                break;
+            }
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
             break;
 
         case RAM_SAVE_FLAG_PAGE:
+            if (ram_load_threads_active()) {
+                ram_load_page_with_threads(f, host, false, 0);
+                break;
+            }
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
 
@@ -3862,6 +4154,10 @@ static int ram_load_precopy(QEMUFile *f)
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
+            /* The delta applies on top of the previous copy of the page */
+            if (ram_load_threads_active()) {
+                ram_load_thread_wait(ram_load_thread_of(host));
+            }
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
                              RAM_ADDR_FMT, addr);
@@ -3871,10 +4167,12 @@ static int ram_load_precopy(QEMUFile *f)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
+            wait_for_load_threads_done();
             multifd_recv_sync_main();
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
+                wait_for_load_threads_done();
                 ram_control_load_hook(f, RAM_CONTROL_HOOK, NULL);
             } else {
                 error_report("Unknown combination of migration flags: 0x%x",
@@ -3891,6 +4189,8 @@ static int ram_load_precopy(QEMUFile *f)
     }
 
     ret |= wait_for_decompress_done();
+    /* Device state loaded after this section may look at guest memory */
+    wait_for_load_threads_done();
     return ret;
 }
 
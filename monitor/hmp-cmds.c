@@ -293,6 +293,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->multifd_zero_pages) {
+            monitor_printf(mon, "multifd zero pages: %" PRIu64 " pages\n",
+                           info->ram->multifd_zero_pages);
+        }
     }
 
     if (info->has_disk) {
@@ -339,6 +343,19 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_vcpu_dirty_limit) {
+        DirtyLimitInfoList *limit;
+
+        for (limit = info->vcpu_dirty_limit; limit; limit = limit->next) {
+            monitor_printf(mon, "vcpu %" PRId64 " dirty limit: %" PRIu64
+                           " MB/s, dirty rate: %" PRIu64 " MB/s, "
+                           "throttle percentage: %" PRId64 "\n",
+                           limit->value->cpu_index, limit->value->limit_rate,
+                           limit->value->current_rate,
+                           limit->value->throttle_percentage);
+        }
+    }
+
     if (info->has_postcopy_blocktime) {
         monitor_printf(mon, "postcopy blocktime: %u\n",
                        info->postcopy_blocktime);
@@ -428,6 +445,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_DECOMPRESS_THREADS),
             params->decompress_threads);
+        assert(params->has_load_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_LOAD_THREADS),
+            params->load_threads);
         assert(params->has_throttle_trigger_threshold);
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_THROTTLE_TRIGGER_THRESHOLD),
@@ -1313,6 +1334,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_decompress_threads = true;
         visit_type_uint8(v, param, &p->decompress_threads, &err);
         break;
+    case MIGRATION_PARAMETER_LOAD_THREADS:
+        p->has_load_threads = true;
+        visit_type_uint8(v, param, &p->load_threads, &err);
+        break;
     case MIGRATION_PARAMETER_THROTTLE_TRIGGER_THRESHOLD:
         p->has_throttle_trigger_threshold = true;
         visit_type_uint8(v, param, &p->throttle_trigger_threshold, &err);
@@ -1394,6 +1419,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_LZ4_LEVEL:
+        p->has_multifd_lz4_level = true;
+        visit_type_uint8(v, param, &p->multifd_lz4_level, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         if (!visit_type_size(v, param, &cache_size, &err)) {
@@ -1936,6 +1965,12 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        if (value->has_io_uring_sqpoll_submits) {
+            monitor_printf(mon, "  io-uring-sqpoll-submits=%" PRIu64 "\n",
+                           value->io_uring_sqpoll_submits);
+            monitor_printf(mon, "  io-uring-sqpoll-wakeups=%" PRIu64 "\n",
+                           value->io_uring_sqpoll_wakeups);
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -1603,7 +1603,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     int64_t size;
     uint64_t perm, shared_perm;
     bool readonly = !exp_args->writable;
-    bool shared = !exp_args->writable;
+    bool shared;
     strList *bitmaps;
     size_t i;
     int ret;
@@ -1656,13 +1656,32 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
     if (readonly) {
         exp->nbdflags |= NBD_FLAG_READ_ONLY;
-        if (shared) {
-            exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
-        }
     } else {
         exp->nbdflags |= (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
                           NBD_FLAG_SEND_FAST_ZERO);
     }
+
+    /*
+     * All connections are served from the same BlockBackend, so a flush
+     * requested on one connection also flushes the writes that were
+     * completed on any other connection, as required for multi-conn.
+     */
+    switch (arg->has_multi_conn ? arg->multi_conn : ON_OFF_AUTO_AUTO) {
+    case ON_OFF_AUTO_ON:
+        shared = true;
+        break;
+    case ON_OFF_AUTO_OFF:
+        shared = false;
+        break;
+    case ON_OFF_AUTO_AUTO:
+        shared = readonly;
+        break;
+    default:
+        abort();
+    }
+    if (shared) {
+        exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     exp->size = QEMU_ALIGN_DOWN(size, BDRV_SECTOR_SIZE);
 
     for (bitmaps = arg->bitmaps; bitmaps; bitmaps = bitmaps->next) {
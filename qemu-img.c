@@ -42,14 +42,17 @@
 #include "qemu/module.h"
 #include "qemu/sockets.h"
 #include "qemu/units.h"
+#include "qemu/bitmap.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
 #include "block/block_int.h"
+#include "block/qcow2.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
 #include "crypto/init.h"
 #include "trace/control.h"
 #include "qemu/throttle.h"
+#include "qemu/timer.h"
 #include "block/throttle-groups.h"
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_FULL_VERSION \
@@ -82,6 +85,8 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_STATS = 277,
+    OPTION_SOURCE_SIZE = 278,
 };
 
 typedef enum OutputFormat {
@@ -1668,9 +1673,46 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_COROUTINES 64
+#define MAX_COPY_RANGE_SECTORS (1 * GiB / BDRV_SECTOR_SIZE)
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+typedef struct ImgConvertStageStats {
+    uint64_t requests;
+    uint64_t bytes;
+    int64_t busy_ns;
+} ImgConvertStageStats;
+
+/*
+ * Sequential output to a pipe. The target cannot seek, so everything is
+ * written in a single pass in increasing offset order, with the gaps filled
+ * with zeroes.
+ */
+typedef struct ImgConvertStream {
+    int fd;
+    bool qcow2;
+    int64_t offset;         /* bytes written to @fd so far */
+    int64_t size;           /* total length of the stream */
+    uint8_t *zeroes;
+
+    /* qcow2 only */
+    int cluster_bits;
+    unsigned long *clusters; /* guest clusters that get a host cluster */
+    int64_t nb_clusters;
+    int64_t data_offset;    /* host offset of the first data cluster */
+    int64_t rank_cluster;
+    int64_t rank;           /* number of set bits before rank_cluster */
+} ImgConvertStream;
+
+#define STREAM_ZERO_BUF_SIZE (64 * KiB)
+
+/* A run of sectors with the same allocation status in the source */
+typedef struct ImgConvertExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1703,8 +1745,43 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+    GArray *extents;
+    bool planned;
+    ImgConvertStream *stream_out;
+    bool stream_in;
+    int64_t stream_in_offset;
+    int64_t planned_sectors[BLK_BACKING_FILE + 1];
+    bool stats;
+    int64_t plan_ns;
+    int64_t elapsed_ns;
+    ImgConvertStageStats read_stats;
+    ImgConvertStageStats write_stats;
+    ImgConvertStageStats copy_stats;
+    ImgConvertStageStats zero_stats;
 } ImgConvertState;
 
+static void convert_account(ImgConvertState *s, ImgConvertStageStats *stats,
+                            int64_t start_ns, int nb_sectors)
+{
+    if (s->stats) {
+        stats->requests++;
+        stats->bytes += (uint64_t) nb_sectors << BDRV_SECTOR_BITS;
+        stats->busy_ns += get_clock() - start_ns;
+    }
+}
+
+static void convert_print_stage_stats(const char *name,
+                                      const ImgConvertStageStats *stats,
+                                      int64_t elapsed_ns)
+{
+    double mib = (double) stats->bytes / MiB;
+
+    printf("%-6s %" PRIu64 " requests, %.1f MiB, %.3f s busy, "
+           "%.1f MiB/s\n", name, stats->requests, mib,
+           (double) stats->busy_ns / NANOSECONDS_PER_SECOND,
+           elapsed_ns ? mib * NANOSECONDS_PER_SECOND / elapsed_ns : 0);
+}
+
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
 {
@@ -1717,6 +1794,57 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+/* Returns the extent of the plan that contains @sector_num */
+static const ImgConvertExtent *convert_find_extent(ImgConvertState *s,
+                                                   int64_t sector_num)
+{
+    const ImgConvertExtent *e;
+    guint lo = 0, hi = s->extents->len;
+
+    assert(hi > 0);
+    while (hi - lo > 1) {
+        guint mid = lo + (hi - lo) / 2;
+
+        e = &g_array_index(s->extents, ImgConvertExtent, mid);
+        if (e->sector_num <= sector_num) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    e = &g_array_index(s->extents, ImgConvertExtent, lo);
+    assert(e->sector_num <= sector_num &&
+           sector_num < e->sector_num + e->nb_sectors);
+    return e;
+}
+
+static void convert_plan_extent(ImgConvertState *s, int64_t sector_num,
+                                int nb_sectors,
+                                enum ImgConvertBlockStatus status)
+{
+    ImgConvertExtent *last = NULL;
+
+    if (s->extents->len) {
+        last = &g_array_index(s->extents, ImgConvertExtent,
+                              s->extents->len - 1);
+    }
+
+    s->planned_sectors[status] += nb_sectors;
+    if (last && last->status == status &&
+        last->sector_num + last->nb_sectors == sector_num)
+    {
+        last->nb_sectors += nb_sectors;
+    } else {
+        ImgConvertExtent e = {
+            .sector_num = sector_num,
+            .nb_sectors = nb_sectors,
+            .status     = status,
+        };
+        g_array_append_val(s->extents, e);
+    }
+}
+
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
     int64_t src_cur_offset;
@@ -1738,6 +1866,20 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
+    if (s->sector_next_status <= sector_num && s->stream_in) {
+        /* Nothing is known about a stream except that it contains data */
+        s->status = BLK_DATA;
+        s->sector_next_status = s->total_sectors;
+    }
+
+    if (s->sector_next_status <= sector_num && s->planned) {
+        /* The copy follows the plan instead of querying the source again */
+        const ImgConvertExtent *e = convert_find_extent(s, sector_num);
+
+        s->status = e->status;
+        s->sector_next_status = e->sector_num + e->nb_sectors;
+    }
+
     if (s->sector_next_status <= sector_num) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
@@ -1805,7 +1947,8 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 
     n = MIN(n, s->sector_next_status - sector_num);
     if (s->status == BLK_DATA) {
-        n = MIN(n, s->buf_sectors);
+        /* Offloaded copies do not go through the buffer */
+        n = MIN(n, s->copy_range ? MAX_COPY_RANGE_SECTORS : s->buf_sectors);
     }
 
     /* We need to write complete clusters for compressed images, so if an
@@ -1823,10 +1966,45 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
+/*
+ * Reads from standard input. Coroutines read their requests right after
+ * taking them, without yielding in between, so they arrive in order.
+ */
+static int convert_stream_read(ImgConvertState *s, int64_t offset,
+                               int64_t bytes, uint8_t *buf)
+{
+    ssize_t ret;
+
+    if (offset != s->stream_in_offset) {
+        return -ESPIPE;
+    }
+
+    while (bytes > 0) {
+        ret = read(STDIN_FILENO, buf, bytes);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            error_report("unexpected end of input at byte %" PRId64,
+                         s->stream_in_offset);
+            return -EIO;
+        }
+        s->stream_in_offset += ret;
+        buf += ret;
+        bytes -= ret;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
                                         int nb_sectors, uint8_t *buf)
 {
     uint64_t single_read_until = 0;
+    int64_t start_ns;
     int n, ret;
 
     assert(nb_sectors <= s->buf_sectors);
@@ -1850,7 +2028,13 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
             n = 1;
         }
 
-        ret = blk_co_pread(blk, offset, n << BDRV_SECTOR_BITS, buf, 0);
+        start_ns = s->stats ? get_clock() : 0;
+        if (s->stream_in) {
+            ret = convert_stream_read(s, offset, n << BDRV_SECTOR_BITS, buf);
+        } else {
+            ret = blk_co_pread(blk, offset, n << BDRV_SECTOR_BITS, buf, 0);
+        }
+        convert_account(s, &s->read_stats, start_ns, n);
         if (ret < 0) {
             if (s->salvage) {
                 if (n > 1) {
@@ -1876,11 +2060,95 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
+/* Writes @bytes at @offset of the stream, which must not be behind */
+static int convert_stream_pwrite(ImgConvertStream *st, int64_t offset,
+                                 int64_t bytes, const void *buf)
+{
+    size_t n;
+
+    if (offset < st->offset) {
+        return -ESPIPE;
+    }
+
+    while (st->offset < offset) {
+        n = MIN(offset - st->offset, STREAM_ZERO_BUF_SIZE);
+        if (qemu_write_full(st->fd, st->zeroes, n) != n) {
+            return -errno;
+        }
+        st->offset += n;
+    }
+
+    if (bytes) {
+        if (qemu_write_full(st->fd, buf, bytes) != bytes) {
+            return -errno;
+        }
+        st->offset += bytes;
+    }
+
+    return 0;
+}
+
+/* Returns the offset in the stream that guest @offset is stored at */
+static int64_t convert_stream_host_offset(ImgConvertStream *st, int64_t offset)
+{
+    int64_t cluster = offset >> st->cluster_bits;
+
+    if (!st->qcow2) {
+        return offset;
+    }
+
+    if (cluster >= st->nb_clusters || !test_bit(cluster, st->clusters)) {
+        /* The plan did not expect data here */
+        return -EIO;
+    }
+    if (cluster < st->rank_cluster) {
+        return -ESPIPE;
+    }
+
+    /* Writes only move forward, so the rank can be counted incrementally */
+    st->rank += bitmap_count_one_with_offset(st->clusters, st->rank_cluster,
+                                             cluster - st->rank_cluster);
+    st->rank_cluster = cluster;
+
+    return st->data_offset + (st->rank << st->cluster_bits) +
+           (offset & ((1 << st->cluster_bits) - 1));
+}
+
+static int convert_stream_write(ImgConvertStream *st, int64_t offset,
+                                int64_t bytes, const uint8_t *buf)
+{
+    int64_t n, host_offset;
+    int ret;
+
+    while (bytes > 0) {
+        n = bytes;
+        if (st->qcow2) {
+            n = MIN(n, (1 << st->cluster_bits) -
+                       (offset & ((1 << st->cluster_bits) - 1)));
+        }
+
+        host_offset = convert_stream_host_offset(st, offset);
+        if (host_offset < 0) {
+            return host_offset;
+        }
+        ret = convert_stream_pwrite(st, host_offset, n, buf);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        bytes -= n;
+        buf += n;
+    }
+
+    return 0;
+}
 
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
 {
+    int64_t start_ns;
     int ret;
 
     while (nb_sectors > 0) {
@@ -1909,8 +2177,17 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 (s->compressed &&
                  !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
             {
-                ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, buf, flags);
+                start_ns = s->stats ? get_clock() : 0;
+                if (s->stream_out) {
+                    ret = convert_stream_write(s->stream_out,
+                                               sector_num << BDRV_SECTOR_BITS,
+                                               n << BDRV_SECTOR_BITS, buf);
+                } else {
+                    ret = blk_co_pwrite(s->target,
+                                        sector_num << BDRV_SECTOR_BITS,
+                                        n << BDRV_SECTOR_BITS, buf, flags);
+                }
+                convert_account(s, &s->write_stats, start_ns, n);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1923,10 +2200,12 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 assert(!s->target_has_backing);
                 break;
             }
+            start_ns = s->stats ? get_clock() : 0;
             ret = blk_co_pwrite_zeroes(s->target,
                                        sector_num << BDRV_SECTOR_BITS,
                                        n << BDRV_SECTOR_BITS,
                                        BDRV_REQ_MAY_UNMAP);
+            convert_account(s, &s->zero_stats, start_ns, n);
             if (ret < 0) {
                 return ret;
             }
@@ -1944,6 +2223,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
 static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector_num,
                                               int nb_sectors)
 {
+    int64_t start_ns;
     int n, ret;
 
     while (nb_sectors > 0) {
@@ -1959,9 +2239,11 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
 
         n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
 
+        start_ns = s->stats ? get_clock() : 0;
         ret = blk_co_copy_range(blk, offset, s->target,
                                 sector_num << BDRV_SECTOR_BITS,
                                 n << BDRV_SECTOR_BITS, 0, 0);
+        convert_account(s, &s->copy_stats, start_ns, n);
         if (ret < 0) {
             return ret;
         }
@@ -1972,6 +2254,113 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Copies a range that copy offloading failed for through @buf instead,
+ * which holds at most s->buf_sectors.
+ */
+static int coroutine_fn convert_co_bounce_copy(ImgConvertState *s,
+                                               int64_t sector_num,
+                                               int nb_sectors, uint8_t *buf)
+{
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        n = MIN(nb_sectors, s->buf_sectors);
+
+        ret = convert_co_read(s, sector_num, n, buf);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = convert_co_write(s, sector_num, n, buf, BLK_DATA);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    return 0;
+}
+
+/*
+ * With in-order writes, lets the coroutine that waits for the write at
+ * @wr_offs continue.
+ */
+static void coroutine_fn convert_co_wake_next(ImgConvertState *s,
+                                              int64_t wr_offs)
+{
+    int i;
+
+    s->wr_offs = wr_offs;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            /*
+             * A -> B -> A cannot occur because A has
+             * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+             * B will never enter A during this time window.
+             */
+            qemu_coroutine_enter(s->co[i]);
+            break;
+        }
+    }
+}
+
+typedef struct ConvertWriteCo {
+    ImgConvertState *s;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    enum ImgConvertBlockStatus status;
+    Coroutine *waiter;
+    bool done;
+    int ret;
+} ConvertWriteCo;
+
+static void coroutine_fn convert_co_write_entry(void *opaque)
+{
+    ConvertWriteCo *w = opaque;
+
+    w->ret = convert_co_write(w->s, w->sector_num, w->nb_sectors, w->buf,
+                              w->status);
+    w->done = true;
+    if (w->waiter) {
+        aio_co_wake(w->waiter);
+    }
+}
+
+/*
+ * Compressed writes spend most of their time compressing the data, and the
+ * target driver only needs them to be submitted in order. Start the write in
+ * its own coroutine, let the next in-order write start as soon as this one
+ * has been submitted, and only then wait for it to complete, so that the
+ * data of several writes is compressed in parallel.
+ */
+static int coroutine_fn convert_co_write_pipelined(ImgConvertState *s,
+                                                   int64_t sector_num,
+                                                   int nb_sectors,
+                                                   uint8_t *buf,
+                                                   enum ImgConvertBlockStatus
+                                                   status)
+{
+    ConvertWriteCo w = {
+        .s          = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .buf        = buf,
+        .status     = status,
+    };
+
+    qemu_coroutine_enter(qemu_coroutine_create(convert_co_write_entry, &w));
+    convert_co_wake_next(s, sector_num + nb_sectors);
+
+    while (!w.done) {
+        w.waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    return w.ret;
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1995,6 +2384,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        bool bounce;
+        bool pipelined;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -2024,9 +2415,13 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
                                         s->allocated_sectors, 0);
         }
 
-retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
-        if (status == BLK_DATA && !copy_range) {
+        copy_range = s->copy_range && status == BLK_DATA;
+        /*
+         * Chunks sized for copy offloading do not fit into the buffer if
+         * offloading has been disabled since
+         */
+        bounce = !copy_range && status == BLK_DATA && n > s->buf_sectors;
+        if (status == BLK_DATA && !copy_range && !bounce) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
@@ -2047,13 +2442,20 @@ retry:
             s->wait_sector_num[index] = -1;
         }
 
+        pipelined = false;
         if (s->ret == -EINPROGRESS) {
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
                 if (ret) {
                     s->copy_range = false;
-                    goto retry;
+                    ret = convert_co_bounce_copy(s, sector_num, n, buf);
                 }
+            } else if (bounce) {
+                ret = convert_co_bounce_copy(s, sector_num, n, buf);
+            } else if (s->wr_in_order && s->compressed) {
+                ret = convert_co_write_pipelined(s, sector_num, n, buf,
+                                                 status);
+                pipelined = true;
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
             }
@@ -2064,21 +2466,10 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !pipelined) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_co_wake_next(s, sector_num + n);
         }
     }
 
@@ -2091,10 +2482,190 @@ retry:
     }
 }
 
+/*
+ * Lays out a qcow2 image that can be written in a single pass: the header,
+ * the refcount table and blocks, the L1 and L2 tables and then the data
+ * clusters in guest order. The plan tells which clusters are allocated, so
+ * all metadata can be written before the first data cluster.
+ */
+static int convert_stream_start_qcow2(ImgConvertState *s)
+{
+    ImgConvertStream *st = s->stream_out;
+    int64_t cluster_size = 1 << st->cluster_bits;
+    int64_t l2_entries = cluster_size / sizeof(uint64_t);
+    int64_t refblock_entries = cluster_size / sizeof(uint16_t);
+    int64_t size = s->total_sectors << BDRV_SECTOR_BITS;
+    int64_t l1_size, l1_clusters, nb_l2 = 0, nb_data, nb_host;
+    int64_t nb_refblocks = 0, rt_clusters = 0;
+    int64_t rt_offset, l1_offset, l2_offset, host_offset;
+    int64_t i, j, end;
+    uint64_t *l1_table = NULL;
+    uint8_t *buf;
+    int ret;
+
+    st->nb_clusters = DIV_ROUND_UP(size, cluster_size);
+    st->clusters = bitmap_new(st->nb_clusters);
+    for (i = 0; i < s->extents->len; i++) {
+        const ImgConvertExtent *e =
+            &g_array_index(s->extents, ImgConvertExtent, i);
+
+        if (e->status == BLK_DATA ||
+            (!s->min_sparse && e->status == BLK_ZERO))
+        {
+            j = (e->sector_num << BDRV_SECTOR_BITS) >> st->cluster_bits;
+            end = DIV_ROUND_UP((e->sector_num + e->nb_sectors) <<
+                               BDRV_SECTOR_BITS, cluster_size);
+            bitmap_set(st->clusters, j, end - j);
+        }
+    }
+    nb_data = bitmap_count_one(st->clusters, st->nb_clusters);
+
+    l1_size = DIV_ROUND_UP(st->nb_clusters, l2_entries);
+    if (l1_size > QCOW_MAX_L1_SIZE / sizeof(uint64_t)) {
+        error_report("Image size is too large for this cluster size");
+        return -EFBIG;
+    }
+    for (i = 0; i < l1_size; i++) {
+        end = MIN((i + 1) * l2_entries, st->nb_clusters);
+        if (find_next_bit(st->clusters, end, i * l2_entries) < end) {
+            nb_l2++;
+        }
+    }
+    l1_clusters = DIV_ROUND_UP(l1_size * sizeof(uint64_t), cluster_size);
+
+    /* The refcount structures need to cover themselves as well */
+    for (;;) {
+        int64_t refblocks, clusters;
+
+        nb_host = 1 + rt_clusters + nb_refblocks + l1_clusters + nb_l2 +
+                  nb_data;
+        refblocks = DIV_ROUND_UP(nb_host, refblock_entries);
+        clusters = DIV_ROUND_UP(refblocks * sizeof(uint64_t), cluster_size);
+        if (refblocks == nb_refblocks && clusters == rt_clusters) {
+            break;
+        }
+        nb_refblocks = refblocks;
+        rt_clusters = clusters;
+    }
+
+    rt_offset = cluster_size;
+    l1_offset = rt_offset + (rt_clusters + nb_refblocks) * cluster_size;
+    st->data_offset = l1_offset + (l1_clusters + nb_l2) * cluster_size;
+    st->size = nb_host * cluster_size;
+
+    buf = g_malloc0(cluster_size);
+    *(QCowHeader *) buf = (QCowHeader) {
+        .magic                   = cpu_to_be32(QCOW_MAGIC),
+        .version                 = cpu_to_be32(3),
+        .cluster_bits            = cpu_to_be32(st->cluster_bits),
+        .size                    = cpu_to_be64(size),
+        .l1_size                 = cpu_to_be32(l1_size),
+        .l1_table_offset         = cpu_to_be64(l1_offset),
+        .refcount_table_offset   = cpu_to_be64(rt_offset),
+        .refcount_table_clusters = cpu_to_be32(rt_clusters),
+        .refcount_order          = cpu_to_be32(4),
+        .header_length           = cpu_to_be32(sizeof(QCowHeader)),
+    };
+    ret = convert_stream_pwrite(st, 0, cluster_size, buf);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Refcount table */
+    for (i = 0; i < rt_clusters * l2_entries; i++) {
+        uint64_t *entries = (uint64_t *) buf;
+
+        j = i % l2_entries;
+        entries[j] = i < nb_refblocks ?
+            cpu_to_be64(rt_offset + (rt_clusters + i) * cluster_size) : 0;
+        if (j == l2_entries - 1) {
+            ret = convert_stream_pwrite(st, st->offset, cluster_size, buf);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+    }
+
+    /* Refcount blocks, every cluster is used exactly once */
+    for (i = 0; i < nb_refblocks * refblock_entries; i++) {
+        uint16_t *entries = (uint16_t *) buf;
+
+        j = i % refblock_entries;
+        entries[j] = i < nb_host ? cpu_to_be16(1) : 0;
+        if (j == refblock_entries - 1) {
+            ret = convert_stream_pwrite(st, st->offset, cluster_size, buf);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+    }
+
+    /* L1 table */
+    l1_table = g_malloc0(l1_clusters * cluster_size);
+    l2_offset = st->data_offset - nb_l2 * cluster_size;
+    for (i = 0; i < l1_size; i++) {
+        end = MIN((i + 1) * l2_entries, st->nb_clusters);
+        if (find_next_bit(st->clusters, end, i * l2_entries) < end) {
+            l1_table[i] = cpu_to_be64(l2_offset | QCOW_OFLAG_COPIED);
+            l2_offset += cluster_size;
+        }
+    }
+    ret = convert_stream_pwrite(st, l1_offset, l1_clusters * cluster_size,
+                                l1_table);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* L2 tables */
+    host_offset = st->data_offset;
+    for (i = 0; i < l1_size; i++) {
+        uint64_t *entries = (uint64_t *) buf;
+
+        if (!l1_table[i]) {
+            continue;
+        }
+        for (j = 0; j < l2_entries; j++) {
+            int64_t cluster = i * l2_entries + j;
+
+            entries[j] = 0;
+            if (cluster < st->nb_clusters && test_bit(cluster, st->clusters)) {
+                entries[j] = cpu_to_be64(host_offset | QCOW_OFLAG_COPIED);
+                host_offset += cluster_size;
+            }
+        }
+        ret = convert_stream_pwrite(st, st->offset, cluster_size, buf);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    assert(st->offset == st->data_offset);
+
+out:
+    if (ret < 0) {
+        error_report("error while writing image metadata: %s",
+                     strerror(-ret));
+    }
+    g_free(l1_table);
+    g_free(buf);
+    return ret;
+}
+
+static int convert_stream_check_opt(void *opaque, const char *name,
+                                    const char *value, Error **errp)
+{
+    if (strcmp(name, BLOCK_OPT_SIZE) && strcmp(name, BLOCK_OPT_CLUSTER_SIZE)) {
+        error_setg(errp, "Option '%s' is not supported for streaming output",
+                   name);
+        return -1;
+    }
+    return 0;
+}
+
 static int convert_do_copy(ImgConvertState *s)
 {
     int ret, i, n;
     int64_t sector_num = 0;
+    int64_t start_ns;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     if (!s->has_zero_init && s->target_is_new && s->min_sparse &&
@@ -2112,6 +2683,12 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    /*
+     * Plan the copy: map the allocation status of the whole source once, so
+     * that the copy can issue requests that span entire extents rather than
+     * querying the block status of each chunk again.
+     */
+    start_ns = get_clock();
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
@@ -2121,14 +2698,29 @@ static int convert_do_copy(ImgConvertState *s)
         {
             s->allocated_sectors += n;
         }
+        convert_plan_extent(s, sector_num, n, s->status);
         sector_num += n;
     }
+    s->plan_ns = get_clock() - start_ns;
+    s->planned = true;
+
+    if (s->stream_out) {
+        if (s->stream_out->qcow2) {
+            ret = convert_stream_start_qcow2(s);
+            if (ret < 0) {
+                return ret;
+            }
+        } else {
+            s->stream_out->size = s->total_sectors << BDRV_SECTOR_BITS;
+        }
+    }
 
     /* Do the copy */
     s->sector_next_status = 0;
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
+    start_ns = get_clock();
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
         s->wait_sector_num[i] = -1;
@@ -2138,6 +2730,18 @@ static int convert_do_copy(ImgConvertState *s)
     while (s->running_coroutines) {
         main_loop_wait(false);
     }
+    s->elapsed_ns = get_clock() - start_ns;
+
+    if (s->stream_out && !s->ret) {
+        /* Fill the stream up to its end */
+        ret = convert_stream_pwrite(s->stream_out, s->stream_out->size,
+                                    0, NULL);
+        if (ret < 0) {
+            error_report("error while writing at byte %" PRId64 ": %s",
+                         s->stream_out->offset, strerror(-ret));
+            return ret;
+        }
+    }
 
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
@@ -2217,6 +2821,7 @@ static int img_convert(int argc, char **argv)
     bool explict_min_sparse = false;
     bool bitmaps = false;
     int64_t rate_limit = 0;
+    int64_t source_size = -1;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2225,6 +2830,8 @@ static int img_convert(int argc, char **argv)
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
+        .extents            = g_array_new(false, false,
+                                          sizeof(ImgConvertExtent)),
     };
 
     for(;;) {
@@ -2237,6 +2844,8 @@ static int img_convert(int argc, char **argv)
             {"salvage", no_argument, 0, OPTION_SALVAGE},
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
+            {"stats", no_argument, 0, OPTION_STATS},
+            {"source-size", required_argument, 0, OPTION_SOURCE_SIZE},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WUr:",
@@ -2371,6 +2980,20 @@ static int img_convert(int argc, char **argv)
         case OPTION_BITMAPS:
             bitmaps = true;
             break;
+        case OPTION_STATS:
+            s.stats = true;
+            break;
+        case OPTION_SOURCE_SIZE:
+            source_size = cvtnum("source size", optarg);
+            if (source_size < 0) {
+                goto fail_getopt;
+            }
+            if (!QEMU_IS_ALIGNED(source_size, BDRV_SECTOR_SIZE)) {
+                error_report("Source size must be a multiple of %d",
+                             BDRV_SECTOR_SIZE);
+                goto fail_getopt;
+            }
+            break;
         }
     }
 
@@ -2432,6 +3055,47 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (!strcmp(out_filename, "-")) {
+        const char *conflict = NULL;
+
+        if (skip_create) {
+            conflict = "-n";
+        } else if (out_baseimg) {
+            conflict = "-B";
+        } else if (s.compressed) {
+            conflict = "-c";
+        } else if (s.copy_range) {
+            conflict = "-C";
+        } else if (!s.wr_in_order) {
+            conflict = "-W";
+        } else if (rate_limit) {
+            conflict = "-r";
+        } else if (progress) {
+            conflict = "-p";
+        } else if (bitmaps) {
+            conflict = "--bitmaps";
+        } else if (s.stats) {
+            conflict = "--stats";
+        }
+        if (conflict) {
+            error_report("Cannot use %s when writing to standard output",
+                         conflict);
+            goto fail_getopt;
+        }
+        if (strcmp(out_fmt, "raw") && strcmp(out_fmt, "qcow2")) {
+            error_report("Streaming output is only supported for raw and "
+                         "qcow2");
+            goto fail_getopt;
+        }
+
+        s.stream_out = g_new0(ImgConvertStream, 1);
+        s.stream_out->fd = STDOUT_FILENO;
+        s.stream_out->qcow2 = !strcmp(out_fmt, "qcow2");
+        s.stream_out->zeroes = g_malloc0(STREAM_ZERO_BUF_SIZE);
+        /* Whatever is not written ends up as zeroes */
+        s.has_zero_init = true;
+    }
+
     /* ret is still -EINVAL until here */
     ret = bdrv_parse_cache_mode(src_cache, &src_flags, &src_writethrough);
     if (ret < 0) {
@@ -2452,6 +3116,35 @@ static int img_convert(int argc, char **argv)
 
     for (bs_i = 0; bs_i < s.src_num; bs_i++) {
         BlockDriverState *src_bs;
+
+        if (!strcmp(argv[optind + bs_i], "-")) {
+            if (s.src_num > 1 || image_opts || (fmt && strcmp(fmt, "raw"))) {
+                error_report("Streaming input is only supported for a single "
+                             "raw image");
+                ret = -1;
+                goto out;
+            }
+            if (s.copy_range || s.salvage || bitmaps || sn_opts ||
+                snapshot_name)
+            {
+                error_report("Cannot use -C, -l, --bitmaps or --salvage when "
+                             "reading from standard input");
+                ret = -1;
+                goto out;
+            }
+            if (source_size < 0) {
+                error_report("Reading from standard input requires "
+                             "--source-size");
+                ret = -1;
+                goto out;
+            }
+            s.stream_in = true;
+            s.src_sectors[bs_i] = source_size / BDRV_SECTOR_SIZE;
+            s.src_alignment[bs_i] = 1;
+            s.total_sectors += s.src_sectors[bs_i];
+            continue;
+        }
+
         s.src[bs_i] = img_open(image_opts, argv[optind + bs_i],
                                fmt, src_flags, src_writethrough, s.quiet,
                                force_share);
@@ -2476,6 +3169,13 @@ static int img_convert(int argc, char **argv)
         s.total_sectors += s.src_sectors[bs_i];
     }
 
+    if (source_size >= 0 && !s.stream_in) {
+        error_report("--source-size can only be used when reading from "
+                     "standard input");
+        ret = -1;
+        goto out;
+    }
+
     if (sn_opts) {
         bdrv_snapshot_load_tmp(blk_bs(s.src[0]),
                                qemu_opt_get(sn_opts, SNAPSHOT_OPT_ID),
@@ -2625,10 +3325,37 @@ static int img_convert(int argc, char **argv)
      * bdrv_create() will purge "opts", so extract them now before
      * they are lost.
      */
-    if (!skip_create) {
+    if (s.stream_out) {
+        uint64_t cluster_size;
+
+        if (qemu_opt_foreach(opts, convert_stream_check_opt, NULL,
+                             &local_err)) {
+            error_report_err(local_err);
+            ret = -1;
+            goto out;
+        }
+
+        cluster_size = qemu_opt_get_size(opts, BLOCK_OPT_CLUSTER_SIZE,
+                                         DEFAULT_CLUSTER_SIZE);
+        if (!is_power_of_2(cluster_size) ||
+            cluster_size < (1 << MIN_CLUSTER_BITS) ||
+            cluster_size > (1 << MAX_CLUSTER_BITS)) {
+            error_report("Cluster size must be a power of two between %d and "
+                         "%dk", 1 << MIN_CLUSTER_BITS,
+                         1 << (MAX_CLUSTER_BITS - 10));
+            ret = -1;
+            goto out;
+        }
+        s.stream_out->cluster_bits = ctz32(cluster_size);
+    } else if (!skip_create) {
         open_opts = qdict_new();
         qemu_opt_foreach(opts, img_add_key_secrets, open_opts, &error_abort);
 
+        /* Let qcow2 compress as many clusters at a time as we write */
+        if (s.compressed && !strcmp(drv->format_name, "qcow2")) {
+            qdict_put_int(open_opts, "max-threads", s.num_coroutines);
+        }
+
         /* Create the new image */
         ret = bdrv_create(drv, out_filename, opts, &local_err);
         if (ret < 0) {
@@ -2647,7 +3374,9 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    if (skip_create) {
+    if (s.stream_out) {
+        /* Written without a block driver, see convert_stream_write() */
+    } else if (skip_create) {
         s.target = img_open(tgt_image_opts, out_filename, out_fmt,
                             flags, writethrough, s.quiet, false);
     } else {
@@ -2660,11 +3389,11 @@ static int img_convert(int argc, char **argv)
                                  flags, writethrough, s.quiet, false);
         open_opts = NULL; /* blk_new_open will have freed it */
     }
-    if (!s.target) {
+    if (!s.target && !s.stream_out) {
         ret = -1;
         goto out;
     }
-    out_bs = blk_bs(s.target);
+    out_bs = s.target ? blk_bs(s.target) : NULL;
 
     if (bitmaps && !bdrv_supports_persistent_dirty_bitmap(out_bs)) {
         error_report("Format driver '%s' does not support bitmaps",
@@ -2682,17 +3411,19 @@ static int img_convert(int argc, char **argv)
     /* increase bufsectors from the default 4096 (2M) if opt_transfer
      * or discard_alignment of the out_bs is greater. Limit to
      * MAX_BUF_SECTORS as maximum which is currently 32768 (16MB). */
-    s.buf_sectors = MIN(MAX_BUF_SECTORS,
-                        MAX(s.buf_sectors,
-                            MAX(out_bs->bl.opt_transfer >> BDRV_SECTOR_BITS,
-                                out_bs->bl.pdiscard_alignment >>
-                                BDRV_SECTOR_BITS)));
+    if (out_bs) {
+        s.buf_sectors = MIN(MAX_BUF_SECTORS,
+                            MAX(s.buf_sectors,
+                                MAX(out_bs->bl.opt_transfer >> BDRV_SECTOR_BITS,
+                                    out_bs->bl.pdiscard_alignment >>
+                                    BDRV_SECTOR_BITS)));
+    }
 
     /* try to align the write requests to the destination to avoid unnecessary
      * RMW cycles. */
     s.alignment = MAX(pow2floor(s.min_sparse),
-                      DIV_ROUND_UP(out_bs->bl.request_alignment,
-                                   BDRV_SECTOR_SIZE));
+                      out_bs ? DIV_ROUND_UP(out_bs->bl.request_alignment,
+                                            BDRV_SECTOR_SIZE) : 1);
     assert(is_power_of_2(s.alignment));
 
     if (skip_create) {
@@ -2720,7 +3451,7 @@ static int img_convert(int argc, char **argv)
         s.target_backing_sectors = -1;
     }
 
-    ret = bdrv_get_info(out_bs, &bdi);
+    ret = out_bs ? bdrv_get_info(out_bs, &bdi) : -ENOTSUP;
     if (ret < 0) {
         if (s.compressed) {
             error_report("could not get block driver info");
@@ -2747,6 +3478,21 @@ out:
         qemu_progress_print(100, 0);
     }
     qemu_progress_end();
+    if (!ret && s.stats) {
+        printf("plan:  %u extents, %.1f MiB data, %.1f MiB zero, "
+               "%.1f MiB unallocated, %.3f s\n", s.extents->len,
+               (double) (s.planned_sectors[BLK_DATA] << BDRV_SECTOR_BITS) / MiB,
+               (double) (s.planned_sectors[BLK_ZERO] << BDRV_SECTOR_BITS) / MiB,
+               (double) (s.planned_sectors[BLK_BACKING_FILE] <<
+                         BDRV_SECTOR_BITS) / MiB,
+               (double) s.plan_ns / NANOSECONDS_PER_SECOND);
+        convert_print_stage_stats("read:", &s.read_stats, s.elapsed_ns);
+        convert_print_stage_stats("write:", &s.write_stats, s.elapsed_ns);
+        convert_print_stage_stats("copy:", &s.copy_stats, s.elapsed_ns);
+        convert_print_stage_stats("zero:", &s.zero_stats, s.elapsed_ns);
+        printf("total: %.3f s\n",
+               (double) s.elapsed_ns / NANOSECONDS_PER_SECOND);
+    }
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qobject_unref(open_opts);
@@ -2760,6 +3506,12 @@ out:
     g_free(s.src_sectors);
     g_free(s.src_alignment);
 fail_getopt:
+    g_array_free(s.extents, true);
+    if (s.stream_out) {
+        g_free(s.stream_out->clusters);
+        g_free(s.stream_out->zeroes);
+        g_free(s.stream_out);
+    }
     qemu_opts_del(sn_opts);
     g_free(options);
 
@@ -1074,6 +1074,9 @@ int main(int argc, char **argv)
             .bitmaps              = bitmaps,
             .has_allocation_depth = alloc_depth,
             .allocation_depth     = alloc_depth,
+            .has_multi_conn       = true,
+            .multi_conn           = shared > 1 ? ON_OFF_AUTO_ON
+                                               : ON_OFF_AUTO_AUTO,
         },
     };
     blk_exp_add(export_opts, &error_fatal);
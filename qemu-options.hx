@@ -139,6 +139,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
@@ -165,6 +166,16 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``dirty-ring-size=n``
+        When the KVM accelerator is used, it controls the size of the per-vCPU
+        dirty page ring buffer (number of entries for each vCPU). It should
+        be a value that is power of two, and it should be 1024 or bigger (but
+        still less than the maximum value that the kernel supports).  4096
+        could be a good initial value if you have no idea which is the best.
+        Set this value to 0 to disable the feature.  By default, this feature
+        is disabled (dirty-ring-size=0), and KVM records dirty pages in a
+        bitmap instead.
+
     ``split-wx=on|off``
         Controls the use of split w^x mapping for the TCG code generation
         buffer. Some operating systems require this to be enabled, and in
@@ -4981,7 +4992,7 @@ SRST
                  -object secret,id=sec0,keyid=secmaster0,format=base64,\\
                      data=$SECRET,iv=$(<iv.b64)
 
-    ``-object sev-guest,id=id,cbitpos=cbitpos,reduced-phys-bits=val,[sev-device=string,policy=policy,handle=handle,dh-cert-file=file,session-file=file]``
+    ``-object sev-guest,id=id,cbitpos=cbitpos,reduced-phys-bits=val,[sev-device=string,policy=policy,handle=handle,dh-cert-file=file,session-file=file,kernel-hashes=on|off,measurement-cache-dir=dir]``
         Create a Secure Encrypted Virtualization (SEV) guest object,
         which can be used to provide the guest memory encryption support
         on AMD processors.
@@ -5021,6 +5032,16 @@ SRST
         session with the guest owner to negotiate keys used for
         attestation. The file must be encoded in base64.
 
+        The ``kernel-hashes`` adds the hashes of given kernel/initrd/
+        cmdline to a designated guest firmware page for measured Linux
+        boot with -kernel. The default is off.
+
+        The ``measurement-cache-dir`` names a directory in which the
+        kernel hashes table and the expected launch digest are cached,
+        keyed by the contents of the firmware, kernel, initrd and command
+        line. Launches that hit the cache skip computing the launch
+        digest. Cache statistics are reported by ``query-sev``.
+
         e.g to launch a SEV guest
 
         .. parsed-literal::
@@ -5136,7 +5157,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink[,io-uring-sqpoll=on|off][,io-uring-sqpoll-idle=ms][,io-uring-sqpoll-cpu=cpu]``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5179,6 +5200,18 @@ SRST
         ::
 
             (qemu) qom-set /objects/iothread1 poll-max-ns 100000
+
+        The ``io-uring-sqpoll=on`` parameter makes the io_uring instance
+        used by ``aio=io_uring`` block nodes in this IOThread submit
+        requests through a kernel polling thread, so that submitting a
+        request does not need a system call while the polling thread is
+        busy. The polling thread goes idle after ``io-uring-sqpoll-idle``
+        milliseconds without work (0 selects the kernel default) and can
+        be bound to host CPU ``io-uring-sqpoll-cpu``. SQPOLL mode requires
+        Linux 5.11 or newer; creating the IOThread fails if the kernel
+        does not support it. These parameters cannot be changed at
+        run-time; ``query-iothreads`` reports how often the polling thread
+        had to be woken up.
 ERST
 
 
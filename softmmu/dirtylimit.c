@@ -0,0 +1,363 @@
+/*
+ * Per-vCPU dirty page rate limit
+ *
+ * Throttles only the vCPUs whose dirty page rate goes over a limit, as
+ * opposed to the auto-converge throttle of cpu-throttle.c which slows
+ * down every vCPU of the guest.  The dirty page rate of each vCPU comes
+ * from the KVM dirty ring, which records which vCPU dirtied each page.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
+#include "exec/memory.h"
+#include "exec/target_page.h"
+#include "sysemu/cpus.h"
+#include "sysemu/kvm.h"
+#include "sysemu/dirtylimit.h"
+#include "trace.h"
+
+#define DIRTYLIMIT_PCT_MAX 99
+#define DIRTYLIMIT_TIMESLICE_NS 10000000
+/* Period over which the dirty page rate of the vCPUs is measured */
+#define DIRTYLIMIT_CALC_PERIOD_MS 1000
+
+typedef struct VcpuDirtyLimitState {
+    int cpu_index;
+    /* Upper limit of the dirty page rate in MB/s, 0 if there is none */
+    uint64_t quota;
+    /* Dirty page rate measured over the last period, in MB/s */
+    uint64_t current_rate;
+    /* Value of CPUState::dirty_pages at the start of the period */
+    uint64_t last_pages;
+    int percentage;
+    int throttle_scheduled;
+    QEMUTimer *timer;
+} VcpuDirtyLimitState;
+
+static struct {
+    VcpuDirtyLimitState *states;
+    int max_cpus;
+    /* Number of vCPUs that have a limit */
+    int nr_limited;
+    QEMUTimer *calc_timer;
+    int64_t calc_start_ms;
+} dirtylimit;
+
+static void dirtylimit_vcpu_thread(CPUState *cpu, run_on_cpu_data opaque)
+{
+    VcpuDirtyLimitState *vs = opaque.host_ptr;
+    double pct;
+    double throttle_ratio;
+    int64_t sleeptime_ns, endtime_ns;
+
+    if (!qatomic_read(&vs->percentage)) {
+        qatomic_set(&vs->throttle_scheduled, 0);
+        return;
+    }
+
+    pct = (double)qatomic_read(&vs->percentage) / 100;
+    throttle_ratio = pct / (1 - pct);
+    /* Add 1ns to fix double's rounding error (like 0.9999999...) */
+    sleeptime_ns = (int64_t)(throttle_ratio * DIRTYLIMIT_TIMESLICE_NS + 1);
+    endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
+    while (sleeptime_ns > 0 && !cpu->stop) {
+        if (sleeptime_ns > SCALE_MS) {
+            qemu_cond_timedwait_iothread(cpu->halt_cond,
+                                         sleeptime_ns / SCALE_MS);
+        } else {
+            qemu_mutex_unlock_iothread();
+            g_usleep(sleeptime_ns / SCALE_US);
+            qemu_mutex_lock_iothread();
+        }
+        sleeptime_ns = endtime_ns - qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+    qatomic_set(&vs->throttle_scheduled, 0);
+}
+
+static void dirtylimit_vcpu_timer_tick(void *opaque)
+{
+    VcpuDirtyLimitState *vs = opaque;
+    CPUState *cpu;
+    double pct;
+
+    /* Stop the timer if needed */
+    if (!qatomic_read(&vs->percentage)) {
+        return;
+    }
+
+    cpu = qemu_get_cpu(vs->cpu_index);
+    if (!cpu) {
+        qatomic_set(&vs->percentage, 0);
+        return;
+    }
+    if (!qatomic_xchg(&vs->throttle_scheduled, 1)) {
+        async_run_on_cpu(cpu, dirtylimit_vcpu_thread,
+                         RUN_ON_CPU_HOST_PTR(vs));
+    }
+
+    pct = (double)qatomic_read(&vs->percentage) / 100;
+    timer_mod(vs->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                         DIRTYLIMIT_TIMESLICE_NS / (1 - pct));
+}
+
+static void dirtylimit_vcpu_set_percentage(VcpuDirtyLimitState *vs, int pct)
+{
+    bool throttle_active = qatomic_read(&vs->percentage) != 0;
+
+    pct = MIN(pct, DIRTYLIMIT_PCT_MAX);
+    pct = MAX(pct, 0);
+    qatomic_set(&vs->percentage, pct);
+
+    if (pct && !throttle_active) {
+        dirtylimit_vcpu_timer_tick(vs);
+    }
+}
+
+/*
+ * The dirty page rate of a vCPU is roughly proportional to the share of
+ * time it runs, so a vCPU dirtying at @current_rate while throttled at
+ * pct% would dirty at @quota if it ran (100 - pct) * quota / current_rate
+ * percent of the time instead.  Lower the throttle by at most half in a
+ * period, so that a vCPU that briefly stops dirtying memory does not
+ * bounce between full speed and a heavy throttle.
+ */
+static void dirtylimit_vcpu_adjust(VcpuDirtyLimitState *vs)
+{
+    int pct = qatomic_read(&vs->percentage);
+    int new_pct;
+
+    if (vs->current_rate > vs->quota) {
+        new_pct = 100 - (100 - pct) * vs->quota / vs->current_rate;
+        new_pct = MAX(new_pct, pct + 1);
+    } else if (vs->current_rate * 10 >= vs->quota * 9) {
+        /* Within 10% under the limit, keep the throttle as it is */
+        new_pct = pct;
+    } else if (vs->current_rate) {
+        new_pct = 100 - MIN((100 - pct) * vs->quota / vs->current_rate, 100);
+        new_pct = MAX(new_pct, pct / 2);
+    } else {
+        new_pct = pct / 2;
+    }
+
+    trace_dirtylimit_vcpu_adjust(vs->cpu_index, vs->quota, vs->current_rate,
+                                 pct, new_pct);
+    if (new_pct != pct) {
+        dirtylimit_vcpu_set_percentage(vs, new_pct);
+    }
+}
+
+static void dirtylimit_calc_start(void)
+{
+    CPUState *cpu;
+
+    /* KVM only pushes pages to the dirty rings while dirty logging is on */
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIMIT);
+    kvm_dirty_ring_reap_all();
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < dirtylimit.max_cpus) {
+            dirtylimit.states[cpu->cpu_index].last_pages = cpu->dirty_pages;
+        }
+    }
+    dirtylimit.calc_start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    timer_mod(dirtylimit.calc_timer,
+              dirtylimit.calc_start_ms + DIRTYLIMIT_CALC_PERIOD_MS);
+}
+
+static void dirtylimit_vcpu_cancel(VcpuDirtyLimitState *vs)
+{
+    if (!vs->quota) {
+        return;
+    }
+
+    trace_dirtylimit_vcpu_set(vs->cpu_index, 0);
+    vs->quota = 0;
+    vs->current_rate = 0;
+    dirtylimit_vcpu_set_percentage(vs, 0);
+    if (!--dirtylimit.nr_limited) {
+        timer_del(dirtylimit.calc_timer);
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_LIMIT);
+    }
+}
+
+static void dirtylimit_calc_timer_tick(void *opaque)
+{
+    int64_t now, period;
+    int i;
+
+    /* Move the pages still in the dirty rings to CPUState::dirty_pages */
+    kvm_dirty_ring_reap_all();
+
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    period = MAX(now - dirtylimit.calc_start_ms, 1);
+    dirtylimit.calc_start_ms = now;
+
+    for (i = 0; i < dirtylimit.max_cpus; i++) {
+        VcpuDirtyLimitState *vs = &dirtylimit.states[i];
+        CPUState *cpu = qemu_get_cpu(i);
+        uint64_t pages;
+
+        if (!cpu) {
+            /* The vCPU was unplugged */
+            dirtylimit_vcpu_cancel(vs);
+            vs->last_pages = 0;
+            continue;
+        }
+
+        pages = cpu->dirty_pages - vs->last_pages;
+        vs->last_pages = cpu->dirty_pages;
+        if (!vs->quota) {
+            continue;
+        }
+
+        vs->current_rate = pages * qemu_target_page_size() * 1000 /
+                           (MiB * period);
+        dirtylimit_vcpu_adjust(vs);
+    }
+
+    if (dirtylimit.nr_limited) {
+        timer_mod(dirtylimit.calc_timer, now + DIRTYLIMIT_CALC_PERIOD_MS);
+    }
+}
+
+static void dirtylimit_init(void)
+{
+    int i;
+
+    if (dirtylimit.states) {
+        return;
+    }
+
+    /* Never freed: throttle work may still be queued on the vCPUs */
+    dirtylimit.max_cpus = current_machine->smp.max_cpus;
+    dirtylimit.states = g_new0(VcpuDirtyLimitState, dirtylimit.max_cpus);
+    for (i = 0; i < dirtylimit.max_cpus; i++) {
+        VcpuDirtyLimitState *vs = &dirtylimit.states[i];
+
+        vs->cpu_index = i;
+        vs->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
+                                 dirtylimit_vcpu_timer_tick, vs);
+    }
+    dirtylimit.calc_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                         dirtylimit_calc_timer_tick, NULL);
+}
+
+static void dirtylimit_vcpu_set(VcpuDirtyLimitState *vs, uint64_t quota)
+{
+    trace_dirtylimit_vcpu_set(vs->cpu_index, quota);
+    if (!vs->quota) {
+        dirtylimit.nr_limited++;
+    }
+    vs->quota = quota;
+}
+
+static bool dirtylimit_check_cpu_index(bool has_cpu_index, int64_t cpu_index,
+                                       Error **errp)
+{
+    if (has_cpu_index &&
+        (cpu_index < 0 || cpu_index >= dirtylimit.max_cpus ||
+         !qemu_get_cpu(cpu_index))) {
+        error_setg(errp, "Invalid cpu-index %" PRId64, cpu_index);
+        return false;
+    }
+    return true;
+}
+
+bool dirtylimit_in_service(void)
+{
+    return dirtylimit.nr_limited > 0;
+}
+
+DirtyLimitInfoList *dirtylimit_query_all(void)
+{
+    DirtyLimitInfoList *head = NULL;
+    int i;
+
+    for (i = dirtylimit.max_cpus - 1; i >= 0; i--) {
+        VcpuDirtyLimitState *vs = &dirtylimit.states[i];
+        DirtyLimitInfo *info;
+
+        if (!vs->quota) {
+            continue;
+        }
+
+        info = g_new0(DirtyLimitInfo, 1);
+        info->cpu_index = i;
+        info->limit_rate = vs->quota;
+        info->current_rate = vs->current_rate;
+        info->throttle_percentage = qatomic_read(&vs->percentage);
+        QAPI_LIST_PREPEND(head, info);
+    }
+
+    return head;
+}
+
+void qmp_set_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                              uint64_t dirty_rate, Error **errp)
+{
+    bool was_in_service = dirtylimit_in_service();
+    int i;
+
+    if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "Dirty page rate limit requires KVM with the dirty "
+                   "ring enabled (-accel kvm,dirty-ring-size=N)");
+        return;
+    }
+    if (!dirty_rate) {
+        error_setg(errp, "dirty-rate must be greater than 0, use "
+                   "cancel-vcpu-dirty-limit to remove a limit");
+        return;
+    }
+
+    dirtylimit_init();
+    if (!dirtylimit_check_cpu_index(has_cpu_index, cpu_index, errp)) {
+        return;
+    }
+
+    if (has_cpu_index) {
+        dirtylimit_vcpu_set(&dirtylimit.states[cpu_index], dirty_rate);
+    } else {
+        for (i = 0; i < dirtylimit.max_cpus; i++) {
+            if (qemu_get_cpu(i)) {
+                dirtylimit_vcpu_set(&dirtylimit.states[i], dirty_rate);
+            }
+        }
+    }
+
+    if (!was_in_service) {
+        dirtylimit_calc_start();
+    }
+}
+
+void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                                 Error **errp)
+{
+    int i;
+
+    if (!dirtylimit_in_service()) {
+        return;
+    }
+    if (!dirtylimit_check_cpu_index(has_cpu_index, cpu_index, errp)) {
+        return;
+    }
+
+    if (has_cpu_index) {
+        dirtylimit_vcpu_cancel(&dirtylimit.states[cpu_index]);
+    } else {
+        for (i = 0; i < dirtylimit.max_cpus; i++) {
+            dirtylimit_vcpu_cancel(&dirtylimit.states[i]);
+        }
+    }
+}
+
+DirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    return dirtylimit_query_all();
+}
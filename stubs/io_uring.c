@@ -21,7 +21,8 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
     abort();
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(bool iopoll, bool sqpoll, uint32_t sqpoll_idle_ms,
+                         int sqpoll_cpu, Error **errp)
 {
     abort();
 }
@@ -701,6 +701,12 @@ void hmp_info_sev(Monitor *mon, const QDict *qdict)
                        info->policy & SEV_POLICY_NODBG ? "off" : "on");
         monitor_printf(mon, "key-sharing: %s\n",
                        info->policy & SEV_POLICY_NOKS ? "off" : "on");
+        if (info->has_measurement_cache) {
+            monitor_printf(mon, "measurement cache: %" PRIu64 " hits, %"
+                           PRIu64 " misses\n",
+                           info->measurement_cache->hits,
+                           info->measurement_cache->misses);
+        }
     } else {
         monitor_printf(mon, "SEV is not enabled\n");
     }
@@ -721,6 +727,8 @@ SevLaunchMeasureInfo *qmp_query_sev_launch_measure(Error **errp)
 
     info = g_malloc0(sizeof(*info));
     info->data = data;
+    info->launch_digest = sev_get_launch_digest();
+    info->has_launch_digest = !!info->launch_digest;
 
     return info;
 }
@@ -44,6 +44,11 @@ char *sev_get_launch_measurement(void)
     return NULL;
 }
 
+char *sev_get_launch_digest(void)
+{
+    return NULL;
+}
+
 SevCapability *sev_get_capabilities(Error **errp)
 {
     error_setg(errp, "SEV is not available in this QEMU");
@@ -59,3 +64,8 @@ int sev_encrypt_flash(uint8_t *ptr, uint64_t len, Error **errp)
 {
     return 0;
 }
+
+bool sev_add_kernel_loader_hashes(SevKernelLoaderContext *ctx, Error **errp)
+{
+    return false;
+}
@@ -22,6 +22,11 @@
 #include "qom/object_interfaces.h"
 #include "qemu/base64.h"
 #include "qemu/module.h"
+#include "qemu/uuid.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "crypto/hash.h"
 #include "sysemu/kvm.h"
 #include "sev_i386.h"
 #include "sysemu/sysemu.h"
@@ -32,11 +37,51 @@
 #include "exec/address-spaces.h"
 #include "monitor/monitor.h"
 #include "exec/confidential-guest-support.h"
+#include "hw/i386/pc.h"
 
 #define TYPE_SEV_GUEST "sev-guest"
 OBJECT_DECLARE_SIMPLE_TYPE(SevGuestState, SEV_GUEST)
 
 
+#define SEV_HASH_TABLE_RV_GUID  "7255371f-3a3b-4b04-927b-1da6efa8d454"
+
+#define SEV_LAUNCH_CACHE_VERSION "qemu-sev-launch-cache-v2"
+
+typedef struct QEMU_PACKED SevHashTableDescriptor {
+    /* SEV hash table area guest address */
+    uint32_t base;
+    /* SEV hash table area size (in bytes) */
+    uint32_t size;
+} SevHashTableDescriptor;
+
+/* hard code sha256 digest size */
+#define HASH_SIZE 32
+
+typedef struct QEMU_PACKED SevHashTableEntry {
+    QemuUUID guid;
+    uint16_t len;
+    uint8_t hash[HASH_SIZE];
+} SevHashTableEntry;
+
+typedef struct QEMU_PACKED SevHashTable {
+    QemuUUID guid;
+    uint16_t len;
+    SevHashTableEntry cmdline;
+    SevHashTableEntry initrd;
+    SevHashTableEntry kernel;
+} SevHashTable;
+
+/*
+ * Data encrypted by sev_encrypt_flash() must be padded to a multiple of
+ * 16 bytes.
+ */
+typedef struct QEMU_PACKED PaddedSevHashTable {
+    SevHashTable ht;
+    uint8_t padding[ROUND_UP(sizeof(SevHashTable), 16) - sizeof(SevHashTable)];
+} PaddedSevHashTable;
+
+QEMU_BUILD_BUG_ON(sizeof(PaddedSevHashTable) % 16 != 0);
+
 /**
  * SevGuestState:
  *
@@ -57,6 +102,8 @@ struct SevGuestState {
     char *session_file;
     uint32_t cbitpos;
     uint32_t reduced_phys_bits;
+    bool kernel_hashes;
+    char *measurement_cache_dir;
 
     /* runtime state */
     uint32_t handle;
@@ -67,11 +114,60 @@ struct SevGuestState {
     int sev_fd;
     SevState state;
     gchar *measurement;
+
+    /* launch measurement cache */
+    GByteArray *measured;
+    uint8_t launch_digest[HASH_SIZE];
+    bool launch_digest_valid;
+    char *cache_pending_path;
+    PaddedSevHashTable *cache_pending_ht;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
 };
 
 #define DEFAULT_GUEST_POLICY    0x1 /* disable debug */
 #define DEFAULT_SEV_DEVICE      "/dev/sev"
 
+/* sev_hash_table_header_guid: 9438d606-4f22-4cc9-b479-a793d411fd21 */
+static const QemuUUID sev_hash_table_header_guid = {
+    .data = UUID_LE(0x9438d606, 0x4f22, 0x4cc9, 0xb4, 0x79, 0xa7, 0x93,
+                    0xd4, 0x11, 0xfd, 0x21)
+};
+
+/* sev_kernel_entry_guid: 4de79437-abd2-427f-b835-d5b172d2045b */
+static const QemuUUID sev_kernel_entry_guid = {
+    .data = UUID_LE(0x4de79437, 0xabd2, 0x427f, 0xb8, 0x35, 0xd5, 0xb1,
+                    0x72, 0xd2, 0x04, 0x5b)
+};
+
+/* sev_initrd_entry_guid: 44baf731-3a2f-4bd7-9af1-41e29169781d */
+static const QemuUUID sev_initrd_entry_guid = {
+    .data = UUID_LE(0x44baf731, 0x3a2f, 0x4bd7, 0x9a, 0xf1, 0x41, 0xe2,
+                    0x91, 0x69, 0x78, 0x1d)
+};
+
+/* sev_cmdline_entry_guid: 97d02dd8-bd20-4c94-aa78-e7714d36ab2a */
+static const QemuUUID sev_cmdline_entry_guid = {
+    .data = UUID_LE(0x97d02dd8, 0xbd20, 0x4c94, 0xaa, 0x78, 0xe7, 0x71,
+                    0x4d, 0x36, 0xab, 0x2a)
+};
+
+/*
+ * SevHashJob:
+ *
+ * One blob (kernel, initrd or cmdline) to be digested by a worker thread
+ * while the others are being hashed concurrently.
+ */
+typedef struct SevHashJob {
+    const char *name;
+    struct iovec iov[2];
+    unsigned int niov;
+    uint8_t hash[HASH_SIZE];
+    QemuThread thread;
+    Error *err;
+    int ret;
+} SevHashJob;
+
 static SevGuestState *sev_guest;
 static Error *sev_mig_blocker;
 
@@ -283,6 +379,40 @@ sev_guest_set_sev_device(Object *obj, const char *value, Error **errp)
     sev->sev_device = g_strdup(value);
 }
 
+static bool
+sev_guest_get_kernel_hashes(Object *obj, Error **errp)
+{
+    SevGuestState *sev = SEV_GUEST(obj);
+
+    return sev->kernel_hashes;
+}
+
+static void
+sev_guest_set_kernel_hashes(Object *obj, bool value, Error **errp)
+{
+    SevGuestState *sev = SEV_GUEST(obj);
+
+    sev->kernel_hashes = value;
+}
+
+static char *
+sev_guest_get_measurement_cache_dir(Object *obj, Error **errp)
+{
+    SevGuestState *sev = SEV_GUEST(obj);
+
+    return g_strdup(sev->measurement_cache_dir);
+}
+
+static void
+sev_guest_set_measurement_cache_dir(Object *obj, const char *value,
+                                    Error **errp)
+{
+    SevGuestState *sev = SEV_GUEST(obj);
+
+    g_free(sev->measurement_cache_dir);
+    sev->measurement_cache_dir = g_strdup(value);
+}
+
 static void
 sev_guest_class_init(ObjectClass *oc, void *data)
 {
@@ -301,6 +431,16 @@ sev_guest_class_init(ObjectClass *oc, void *data)
                                   sev_guest_set_session_file);
     object_class_property_set_description(oc, "session-file",
             "guest owners session parameters (encoded with base64)");
+    object_class_property_add_bool(oc, "kernel-hashes",
+                                   sev_guest_get_kernel_hashes,
+                                   sev_guest_set_kernel_hashes);
+    object_class_property_set_description(oc, "kernel-hashes",
+            "add kernel hashes to guest firmware for measured Linux boot");
+    object_class_property_add_str(oc, "measurement-cache-dir",
+                                  sev_guest_get_measurement_cache_dir,
+                                  sev_guest_set_measurement_cache_dir);
+    object_class_property_set_description(oc, "measurement-cache-dir",
+            "directory caching kernel hashes and launch digests");
 }
 
 static void
@@ -374,6 +514,12 @@ sev_get_info(void)
         info->policy = sev_guest->policy;
         info->state = sev_guest->state;
         info->handle = sev_guest->handle;
+        if (sev_guest->measurement_cache_dir) {
+            info->has_measurement_cache = true;
+            info->measurement_cache = g_new0(SevMeasurementCacheInfo, 1);
+            info->measurement_cache->hits = sev_guest->cache_hits;
+            info->measurement_cache->misses = sev_guest->cache_misses;
+        }
     }
 
     return info;
@@ -490,6 +636,90 @@ sev_read_file_base64(const char *filename, guchar **data, gsize *len)
     return 0;
 }
 
+/*
+ * Build the path of the cache entry for this launch.  The key covers the
+ * contents of everything measured so far (i.e. the firmware) and @padded_ht,
+ * whose hashes cover the patched setup header, the kernel including anything
+ * appended to it (e.g. a dtb), the initrd and the command line.
+ */
+static char *
+sev_launch_cache_path(SevGuestState *sev, const PaddedSevHashTable *padded_ht)
+{
+    g_autofree char *key = NULL;
+    struct iovec iov[3];
+
+    iov[0].iov_base = (void *)SEV_LAUNCH_CACHE_VERSION;
+    iov[0].iov_len = sizeof(SEV_LAUNCH_CACHE_VERSION);
+    iov[1].iov_base = sev->measured->data;
+    iov[1].iov_len = sev->measured->len;
+    iov[2].iov_base = (void *)padded_ht;
+    iov[2].iov_len = sizeof(*padded_ht);
+
+    if (qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, ARRAY_SIZE(iov),
+                             &key, NULL) < 0) {
+        return NULL;
+    }
+
+    return g_strdup_printf("%s/%s.launch", sev->measurement_cache_dir, key);
+}
+
+static bool
+sev_launch_cache_load(const char *path, PaddedSevHashTable *padded_ht,
+                      uint8_t *launch_digest)
+{
+    g_autoptr(GKeyFile) kf = g_key_file_new();
+    g_autofree char *ht_b64 = NULL;
+    g_autofree char *ld_b64 = NULL;
+    g_autofree guchar *ht = NULL;
+    g_autofree guchar *ld = NULL;
+    gsize ht_len, ld_len;
+
+    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, NULL)) {
+        return false;
+    }
+
+    ht_b64 = g_key_file_get_string(kf, "sev-launch", "hashes-table", NULL);
+    ld_b64 = g_key_file_get_string(kf, "sev-launch", "launch-digest", NULL);
+    if (!ht_b64 || !ld_b64) {
+        return false;
+    }
+
+    ht = g_base64_decode(ht_b64, &ht_len);
+    ld = g_base64_decode(ld_b64, &ld_len);
+    if (ht_len != sizeof(*padded_ht) || ld_len != HASH_SIZE) {
+        return false;
+    }
+
+    memcpy(padded_ht, ht, sizeof(*padded_ht));
+    memcpy(launch_digest, ld, HASH_SIZE);
+    return true;
+}
+
+static void
+sev_launch_cache_store(const char *path, const PaddedSevHashTable *padded_ht,
+                       const uint8_t *launch_digest)
+{
+    g_autoptr(GKeyFile) kf = g_key_file_new();
+    g_autofree char *ht_b64 = NULL;
+    g_autofree char *ld_b64 = NULL;
+    g_autofree char *contents = NULL;
+    GError *gerr = NULL;
+    gsize len;
+
+    ht_b64 = g_base64_encode((const guchar *)padded_ht, sizeof(*padded_ht));
+    ld_b64 = g_base64_encode(launch_digest, HASH_SIZE);
+    g_key_file_set_string(kf, "sev-launch", "hashes-table", ht_b64);
+    g_key_file_set_string(kf, "sev-launch", "launch-digest", ld_b64);
+    contents = g_key_file_to_data(kf, &len, NULL);
+
+    /* g_file_set_contents() replaces the file atomically */
+    if (!g_file_set_contents(path, contents, len, &gerr)) {
+        warn_report("SEV: failed to write launch cache entry '%s': %s",
+                    path, gerr->message);
+        g_error_free(gerr);
+    }
+}
+
 static int
 sev_launch_start(SevGuestState *sev)
 {
@@ -548,6 +778,11 @@ sev_launch_update_data(SevGuestState *sev, uint8_t *addr, uint64_t len)
         return 1;
     }
 
+    if (sev->measured) {
+        /* keep the plaintext around to derive the expected launch digest */
+        g_byte_array_append(sev->measured, addr, len);
+    }
+
     update.uaddr = (__u64)(unsigned long)addr;
     update.len = len;
     trace_kvm_sev_launch_update_data(addr, len);
@@ -561,6 +796,48 @@ sev_launch_update_data(SevGuestState *sev, uint8_t *addr, uint64_t len)
     return ret;
 }
 
+/* Drop the recorded plaintext and any pending cache entry */
+static void
+sev_launch_cache_reset(SevGuestState *sev)
+{
+    g_free(sev->cache_pending_path);
+    sev->cache_pending_path = NULL;
+    g_free(sev->cache_pending_ht);
+    sev->cache_pending_ht = NULL;
+    if (sev->measured) {
+        g_byte_array_free(sev->measured, true);
+        sev->measured = NULL;
+    }
+}
+
+/*
+ * The firmware's launch digest is the SHA-256 of everything passed to
+ * LAUNCH_UPDATE_DATA, in order.  Derive it from the recorded plaintext unless
+ * it was served from the cache, and populate the cache entry on a miss.
+ */
+static void
+sev_launch_cache_finish(SevGuestState *sev)
+{
+    uint8_t *hashp = sev->launch_digest;
+    size_t hash_len = HASH_SIZE;
+
+    if (sev->measured && !sev->launch_digest_valid) {
+        if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256,
+                               (const char *)sev->measured->data,
+                               sev->measured->len, &hashp, &hash_len,
+                               NULL) == 0) {
+            sev->launch_digest_valid = true;
+        }
+    }
+
+    if (sev->cache_pending_path && sev->launch_digest_valid) {
+        sev_launch_cache_store(sev->cache_pending_path, sev->cache_pending_ht,
+                               sev->launch_digest);
+    }
+
+    sev_launch_cache_reset(sev);
+}
+
 static void
 sev_launch_get_measure(Notifier *notifier, void *unused)
 {
@@ -570,6 +847,7 @@ sev_launch_get_measure(Notifier *notifier, void *unused)
     struct kvm_sev_launch_measure *measurement;
 
     if (!sev_check_state(sev, SEV_STATE_LAUNCH_UPDATE)) {
+        sev_launch_cache_reset(sev);
         return;
     }
 
@@ -602,10 +880,14 @@ sev_launch_get_measure(Notifier *notifier, void *unused)
     sev->measurement = g_base64_encode(data, measurement->len);
     trace_kvm_sev_launch_measurement(sev->measurement);
 
+    sev_launch_cache_finish(sev);
+
 free_data:
     g_free(data);
 free_measurement:
     g_free(measurement);
+    /* no digest can be derived once LAUNCH_MEASURE has failed */
+    sev_launch_cache_reset(sev);
 }
 
 char *
@@ -619,6 +901,16 @@ sev_get_launch_measurement(void)
     return NULL;
 }
 
+char *
+sev_get_launch_digest(void)
+{
+    if (sev_guest && sev_guest->launch_digest_valid) {
+        return g_base64_encode(sev_guest->launch_digest, HASH_SIZE);
+    }
+
+    return NULL;
+}
+
 static Notifier sev_machine_done_notify = {
     .notify = sev_launch_get_measure,
 };
@@ -732,6 +1024,15 @@ int sev_kvm_init(ConfidentialGuestSupport *cgs, Error **errp)
         goto err;
     }
 
+    if (sev->measurement_cache_dir) {
+        if (!g_file_test(sev->measurement_cache_dir, G_FILE_TEST_IS_DIR)) {
+            error_setg(errp, "%s: measurement cache '%s' is not a directory",
+                       __func__, sev->measurement_cache_dir);
+            goto err;
+        }
+        sev->measured = g_byte_array_new();
+    }
+
     ret = sev_launch_start(sev);
     if (ret) {
         error_setg(errp, "%s: failed to create encryption context", __func__);
@@ -746,6 +1047,7 @@ int sev_kvm_init(ConfidentialGuestSupport *cgs, Error **errp)
 
     return 0;
 err:
+    sev_launch_cache_reset(sev);
     sev_guest = NULL;
     ram_block_discard_disable(false);
     return -1;
@@ -833,6 +1135,200 @@ int sev_inject_launch_secret(const char *packet_hdr, const char *secret,
     return 0;
 }
 
+static void *
+sev_hash_worker(void *opaque)
+{
+    SevHashJob *job = opaque;
+    uint8_t *hashp = job->hash;
+    size_t hash_len = HASH_SIZE;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    job->ret = qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, job->iov,
+                                   job->niov, &hashp, &hash_len, &job->err);
+    assert(job->ret < 0 || hash_len == HASH_SIZE);
+
+    trace_kvm_sev_kernel_loader_hash(job->name, iov_size(job->iov, job->niov),
+                                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                     start);
+    return NULL;
+}
+
+static void
+sev_fill_hash_table_entry(SevHashTableEntry *e, const QemuUUID *guid,
+                          const SevHashJob *job)
+{
+    e->guid = *guid;
+    e->len = cpu_to_le16(sizeof(*e));
+    memcpy(e->hash, job->hash, sizeof(e->hash));
+}
+
+/*
+ * Compute the hashes of the linux kernel/initrd/cmdline into @padded_ht.
+ *
+ * The three blobs are digested concurrently, each on its own worker thread,
+ * straight out of the buffers the loader already holds (the kernel and
+ * initrd are mmap()ed files), so launch latency is bounded by the largest
+ * blob rather than by their sum.
+ */
+static bool
+sev_build_hash_table(SevKernelLoaderContext *ctx,
+                     PaddedSevHashTable *padded_ht, Error **errp)
+{
+    SevHashTable *ht = &padded_ht->ht;
+    SevHashJob jobs[3] = {
+        {
+            /*
+             * The kernel hash covers the (patched) setup header followed by
+             * the protected-mode kernel, i.e. exactly what the firmware
+             * fetches through fw_cfg.
+             */
+            .name = "kernel",
+            .iov = {
+                { .iov_base = ctx->setup_data, .iov_len = ctx->setup_size },
+                { .iov_base = ctx->kernel_data, .iov_len = ctx->kernel_size },
+            },
+            .niov = 2,
+        }, {
+            /* An empty buffer is hashed when no -initrd was given */
+            .name = "initrd",
+            .iov = {
+                { .iov_base = ctx->initrd_data, .iov_len = ctx->initrd_size },
+            },
+            .niov = 1,
+        }, {
+            /* The command line is hashed including its terminating NUL */
+            .name = "cmdline",
+            .iov = {
+                { .iov_base = ctx->cmdline_data, .iov_len = ctx->cmdline_size },
+            },
+            .niov = 1,
+        },
+    };
+    SevHashJob *kernel = &jobs[0], *initrd = &jobs[1], *cmdline = &jobs[2];
+    bool ret = true;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(jobs); i++) {
+        qemu_thread_create(&jobs[i].thread, "sev-hash", sev_hash_worker,
+                           &jobs[i], QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < ARRAY_SIZE(jobs); i++) {
+        qemu_thread_join(&jobs[i].thread);
+    }
+    for (i = 0; i < ARRAY_SIZE(jobs); i++) {
+        if (jobs[i].ret < 0) {
+            if (ret) {
+                error_propagate_prepend(errp, jobs[i].err,
+                                        "SEV: failed to hash %s: ",
+                                        jobs[i].name);
+                ret = false;
+            } else {
+                error_free(jobs[i].err);
+            }
+        }
+    }
+    if (!ret) {
+        return false;
+    }
+
+    memset(padded_ht, 0, sizeof(*padded_ht));
+    ht->guid = sev_hash_table_header_guid;
+    ht->len = cpu_to_le16(sizeof(*ht));
+    sev_fill_hash_table_entry(&ht->cmdline, &sev_cmdline_entry_guid, cmdline);
+    sev_fill_hash_table_entry(&ht->initrd, &sev_initrd_entry_guid, initrd);
+    sev_fill_hash_table_entry(&ht->kernel, &sev_kernel_entry_guid, kernel);
+
+    return true;
+}
+
+/*
+ * Add the hashes of the linux kernel/initrd/cmdline to an encrypted guest page
+ * which is included in SEV's initial memory measurement.
+ *
+ * If a measurement cache directory was configured and an entry for the same
+ * firmware and hashes table exists, the expected launch digest is taken from
+ * it instead of being recomputed when the launch finishes.
+ */
+bool
+sev_add_kernel_loader_hashes(SevKernelLoaderContext *ctx, Error **errp)
+{
+    SevGuestState *sev = sev_guest;
+    uint8_t *data;
+    SevHashTableDescriptor *area;
+    PaddedSevHashTable table, cached_table, *padded_ht;
+    uint8_t cached_digest[HASH_SIZE];
+    g_autofree char *cache_path = NULL;
+    hwaddr mapped_len = sizeof(*padded_ht);
+    MemTxAttrs attrs = { 0 };
+    bool ret = true;
+
+    /*
+     * Only add the kernel hashes if the sev-guest configuration explicitly
+     * stated kernel-hashes=on.
+     */
+    if (!sev || !sev->kernel_hashes) {
+        return false;
+    }
+
+    if (!pc_system_ovmf_table_find(SEV_HASH_TABLE_RV_GUID, &data, NULL)) {
+        error_setg(errp, "SEV: kernel specified but guest firmware "
+                         "has no hashes table GUID");
+        return false;
+    }
+    area = (SevHashTableDescriptor *)data;
+    if (!area->base || area->size < sizeof(PaddedSevHashTable)) {
+        error_setg(errp, "SEV: guest firmware hashes table area is invalid "
+                         "(base=0x%x size=0x%x)", area->base, area->size);
+        return false;
+    }
+
+    if (!sev_build_hash_table(ctx, &table, errp)) {
+        return false;
+    }
+
+    if (sev->measured) {
+        cache_path = sev_launch_cache_path(sev, &table);
+    }
+    /* Only trust an entry whose table matches the one just computed */
+    if (cache_path &&
+        sev_launch_cache_load(cache_path, &cached_table, cached_digest) &&
+        !memcmp(&cached_table, &table, sizeof(table))) {
+        trace_kvm_sev_launch_cache(cache_path, true);
+        sev->cache_hits++;
+        memcpy(sev->launch_digest, cached_digest, HASH_SIZE);
+        sev->launch_digest_valid = true;
+        /* the launch digest is known, stop recording measured data */
+        g_byte_array_free(sev->measured, true);
+        sev->measured = NULL;
+    } else if (cache_path) {
+        trace_kvm_sev_launch_cache(cache_path, false);
+        sev->cache_misses++;
+        sev->cache_pending_path = g_steal_pointer(&cache_path);
+        sev->cache_pending_ht = g_memdup(&table, sizeof(table));
+    }
+
+    /*
+     * Populate the hashes table in the guest's memory at the OVMF-designated
+     * area for the SEV hashes table
+     */
+    padded_ht = address_space_map(&address_space_memory, area->base,
+                                  &mapped_len, true, attrs);
+    if (!padded_ht || mapped_len != sizeof(*padded_ht)) {
+        error_setg(errp, "SEV: cannot map hashes table guest memory area");
+        return false;
+    }
+    memcpy(padded_ht, &table, sizeof(*padded_ht));
+
+    if (sev_encrypt_flash((uint8_t *)padded_ht, sizeof(*padded_ht), errp) < 0) {
+        ret = false;
+    }
+
+    address_space_unmap(&address_space_memory, padded_ht,
+                        mapped_len, true, mapped_len);
+
+    return ret;
+}
+
 static void
 sev_register_types(void)
 {
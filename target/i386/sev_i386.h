@@ -34,6 +34,7 @@ extern SevInfo *sev_get_info(void);
 extern uint32_t sev_get_cbit_position(void);
 extern uint32_t sev_get_reduced_phys_bits(void);
 extern char *sev_get_launch_measurement(void);
+extern char *sev_get_launch_digest(void);
 extern SevCapability *sev_get_capabilities(Error **errp);
 
 #endif
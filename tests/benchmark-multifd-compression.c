@@ -0,0 +1,305 @@
+/*
+ * Multifd compression methods speed benchmark
+ *
+ * Compresses synthetic RAM images in multifd packet sized chunks with
+ * the libraries behind each multifd compression method, at the
+ * default level of the method.  lz4 goes through the same packet stream
+ * code as the multifd lz4 method.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include "../migration/multifd-lz4-stream.h"
+#endif
+
+#define BENCH_PAGE_SIZE   4096
+/* Same as MULTIFD_PACKET_SIZE */
+#define BENCH_PACKET_SIZE (512 * KiB)
+#define BENCH_IMAGE_SIZE  (64 * MiB)
+#define BENCH_PACKETS     (BENCH_IMAGE_SIZE / BENCH_PACKET_SIZE)
+
+typedef enum {
+    /* idle guest: mostly zero pages, some text and some random data */
+    BENCH_IMAGE_SPARSE,
+    /* page cache full of text-like, compressible data */
+    BENCH_IMAGE_TEXT,
+    /* encrypted or already compressed data */
+    BENCH_IMAGE_RANDOM,
+    BENCH_IMAGE__MAX,
+} BenchImage;
+
+static const char *const image_names[BENCH_IMAGE__MAX] = {
+    [BENCH_IMAGE_SPARSE] = "sparse",
+    [BENCH_IMAGE_TEXT] = "text",
+    [BENCH_IMAGE_RANDOM] = "random",
+};
+
+typedef struct BenchMethod {
+    const char *name;
+    int level;
+    /* Optional, called before compressing an image */
+    void (*reset)(const struct BenchMethod *m);
+    /* Returns the compressed size, or 0 on error */
+    size_t (*compress)(const struct BenchMethod *m, const uint8_t *in,
+                       size_t in_len, uint8_t *out, size_t out_len);
+    /* Returns the decompressed size, or 0 on error */
+    size_t (*decompress)(const uint8_t *in, size_t in_len,
+                         uint8_t *out, size_t out_len);
+} BenchMethod;
+
+static size_t none_compress(const BenchMethod *m, const uint8_t *in,
+                            size_t in_len, uint8_t *out, size_t out_len)
+{
+    memcpy(out, in, in_len);
+    return in_len;
+}
+
+static size_t none_decompress(const uint8_t *in, size_t in_len,
+                              uint8_t *out, size_t out_len)
+{
+    memcpy(out, in, in_len);
+    return in_len;
+}
+
+static size_t zlib_compress(const BenchMethod *m, const uint8_t *in,
+                            size_t in_len, uint8_t *out, size_t out_len)
+{
+    uLongf len = out_len;
+
+    if (compress2(out, &len, in, in_len, m->level) != Z_OK) {
+        return 0;
+    }
+    return len;
+}
+
+static size_t zlib_decompress(const uint8_t *in, size_t in_len,
+                              uint8_t *out, size_t out_len)
+{
+    uLongf len = out_len;
+
+    if (uncompress(out, &len, in, in_len) != Z_OK) {
+        return 0;
+    }
+    return len;
+}
+
+#ifdef CONFIG_ZSTD
+static size_t zstd_compress(const BenchMethod *m, const uint8_t *in,
+                            size_t in_len, uint8_t *out, size_t out_len)
+{
+    size_t ret = ZSTD_compress(out, out_len, in, in_len, m->level);
+
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+
+static size_t zstd_decompress(const uint8_t *in, size_t in_len,
+                              uint8_t *out, size_t out_len)
+{
+    size_t ret = ZSTD_decompress(out, out_len, in, in_len);
+
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+#endif
+
+#ifdef CONFIG_LZ4
+/* The packets of an image form one stream, like those of a channel */
+static MultiFDLz4Stream *lz4_send, *lz4_recv;
+
+static void lz4_reset(const BenchMethod *m)
+{
+    if (lz4_send) {
+        multifd_lz4_stream_free(lz4_send);
+        multifd_lz4_stream_free(lz4_recv);
+    }
+    lz4_send = multifd_lz4_stream_new(m->level, BENCH_PACKET_SIZE);
+    lz4_recv = multifd_lz4_stream_new(-1, BENCH_PACKET_SIZE);
+    g_assert(lz4_send && lz4_recv);
+}
+
+static size_t lz4_compress(const BenchMethod *m, const uint8_t *in,
+                           size_t in_len, uint8_t *out, size_t out_len)
+{
+    struct iovec iov = { .iov_base = (void *)in, .iov_len = in_len };
+    uint32_t ret = multifd_lz4_stream_compress(lz4_send, &iov, 1, in_len);
+
+    if (!ret || ret > out_len) {
+        return 0;
+    }
+    memcpy(out, lz4_send->zbuff, ret);
+    return ret;
+}
+
+static size_t lz4_decompress(const uint8_t *in, size_t in_len,
+                             uint8_t *out, size_t out_len)
+{
+    struct iovec iov = { .iov_base = out, .iov_len = out_len };
+
+    if (in_len > lz4_recv->zbuff_len) {
+        return 0;
+    }
+    memcpy(lz4_recv->zbuff, in, in_len);
+    if (multifd_lz4_stream_decompress(lz4_recv, in_len, &iov, 1,
+                                      out_len) < 0) {
+        return 0;
+    }
+    return out_len;
+}
+#endif
+
+static const BenchMethod methods[] = {
+    { "none", 0, NULL, none_compress, none_decompress },
+    { "zlib", 1, NULL, zlib_compress, zlib_decompress },
+#ifdef CONFIG_ZSTD
+    { "zstd", 1, NULL, zstd_compress, zstd_decompress },
+#endif
+#ifdef CONFIG_LZ4
+    { "lz4", 0, lz4_reset, lz4_compress, lz4_decompress },
+    { "lz4", 1, lz4_reset, lz4_compress, lz4_decompress },
+    { "lz4", 9, lz4_reset, lz4_compress, lz4_decompress },
+#endif
+};
+
+static void fill_text_page(uint8_t *page)
+{
+    static const char *const words[] = {
+        "migration ", "multifd ", "channel ", "page ", "dirty ", "the ",
+        "of ", "guest ", "memory ", "0x00000000 ", "\n", "kernel ",
+    };
+    size_t pos = 0;
+
+    while (pos < BENCH_PAGE_SIZE) {
+        const char *w = words[g_test_rand_int_range(0, ARRAY_SIZE(words))];
+        size_t len = MIN(strlen(w), BENCH_PAGE_SIZE - pos);
+
+        memcpy(page + pos, w, len);
+        pos += len;
+    }
+}
+
+static void fill_random_page(uint8_t *page)
+{
+    size_t i;
+
+    for (i = 0; i < BENCH_PAGE_SIZE; i += sizeof(uint32_t)) {
+        uint32_t v = g_test_rand_int();
+
+        memcpy(page + i, &v, sizeof(v));
+    }
+}
+
+static void fill_image(uint8_t *image, BenchImage type)
+{
+    size_t i;
+
+    for (i = 0; i < BENCH_IMAGE_SIZE; i += BENCH_PAGE_SIZE) {
+        uint8_t *page = image + i;
+        int dice = g_test_rand_int_range(0, 100);
+
+        switch (type) {
+        case BENCH_IMAGE_SPARSE:
+            if (dice < 70) {
+                memset(page, 0, BENCH_PAGE_SIZE);
+            } else if (dice < 90) {
+                fill_text_page(page);
+            } else {
+                fill_random_page(page);
+            }
+            break;
+        case BENCH_IMAGE_TEXT:
+            fill_text_page(page);
+            break;
+        case BENCH_IMAGE_RANDOM:
+            fill_random_page(page);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    }
+}
+
+static void bench_method(const BenchMethod *m, BenchImage type,
+                         const uint8_t *image, uint8_t *out, size_t out_len,
+                         size_t *sizes, uint8_t *check)
+{
+    double total = BENCH_IMAGE_SIZE;
+    double compressed = 0;
+    double comp_time;
+    size_t i;
+
+    if (m->reset) {
+        m->reset(m);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_PACKETS; i++) {
+        sizes[i] = m->compress(m, image + i * BENCH_PACKET_SIZE,
+                               BENCH_PACKET_SIZE, out + i * out_len, out_len);
+        g_assert(sizes[i]);
+        compressed += sizes[i];
+    }
+    comp_time = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_PACKETS; i++) {
+        size_t ret = m->decompress(out + i * out_len, sizes[i],
+                                   check + i * BENCH_PACKET_SIZE,
+                                   BENCH_PACKET_SIZE);
+        g_assert_cmpuint(ret, ==, BENCH_PACKET_SIZE);
+    }
+    g_test_timer_elapsed();
+    g_assert(memcmp(image, check, BENCH_IMAGE_SIZE) == 0);
+
+    g_test_message("%s level %d on %s image: compress %.2f GB/sec, "
+                   "decompress %.2f GB/sec, ratio %.2f",
+                   m->name, m->level, image_names[type],
+                   total / comp_time / GiB,
+                   total / g_test_timer_last() / GiB,
+                   total / compressed);
+}
+
+static void test_multifd_compression_speed(void)
+{
+    /* generous bound for all the methods on incompressible data */
+    size_t out_len = BENCH_PACKET_SIZE + BENCH_PACKET_SIZE / 8 + 4 * KiB;
+    uint8_t *image = g_malloc(BENCH_IMAGE_SIZE);
+    uint8_t *check = g_malloc(BENCH_IMAGE_SIZE);
+    uint8_t *out = g_malloc(BENCH_PACKETS * out_len);
+    size_t *sizes = g_new(size_t, BENCH_PACKETS);
+    int type;
+    size_t i;
+
+    for (type = 0; type < BENCH_IMAGE__MAX; type++) {
+        fill_image(image, type);
+        for (i = 0; i < ARRAY_SIZE(methods); i++) {
+            bench_method(&methods[i], type, image, out, out_len, sizes,
+                         check);
+        }
+    }
+
+#ifdef CONFIG_LZ4
+    if (lz4_send) {
+        multifd_lz4_stream_free(lz4_send);
+        multifd_lz4_stream_free(lz4_recv);
+    }
+#endif
+    g_free(image);
+    g_free(check);
+    g_free(out);
+    g_free(sizes);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/multifd/compression/benchmark/speed",
+                    test_multifd_compression_speed);
+
+    return g_test_run();
+}
@@ -0,0 +1,161 @@
+/*
+ * XBZRLE encoder/decoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/cutils.h"
+#include "../migration/xbzrle.h"
+
+#define XBZRLE_PAGE_SIZE 4096
+#define XBZRLE_PAGES     4096
+
+typedef enum {
+    /* the whole page is different (encoding overflows) */
+    XBZRLE_BENCH_RANDOM,
+    /* a handful of short changes per page */
+    XBZRLE_BENCH_SPARSE,
+    /* changes cover roughly half of the page in short runs */
+    XBZRLE_BENCH_DENSE,
+    XBZRLE_BENCH__MAX,
+} XBZRLEBenchPattern;
+
+static const char *const pattern_names[XBZRLE_BENCH__MAX] = {
+    [XBZRLE_BENCH_RANDOM] = "random",
+    [XBZRLE_BENCH_SPARSE] = "sparse",
+    [XBZRLE_BENCH_DENSE] = "dense-diff",
+};
+
+typedef struct XBZRLEBenchData {
+    uint8_t *old;
+    uint8_t *new;
+    uint8_t *encoded;
+    int *encoded_len;
+} XBZRLEBenchData;
+
+static void fill_pattern(XBZRLEBenchData *data, XBZRLEBenchPattern pattern)
+{
+    size_t i, j;
+
+    for (i = 0; i < XBZRLE_PAGES * XBZRLE_PAGE_SIZE; i++) {
+        data->old[i] = g_test_rand_int();
+    }
+    memcpy(data->new, data->old, XBZRLE_PAGES * XBZRLE_PAGE_SIZE);
+
+    for (i = 0; i < XBZRLE_PAGES; i++) {
+        uint8_t *page = data->new + i * XBZRLE_PAGE_SIZE;
+
+        switch (pattern) {
+        case XBZRLE_BENCH_RANDOM:
+            for (j = 0; j < XBZRLE_PAGE_SIZE; j++) {
+                page[j] = ~page[j];
+            }
+            break;
+        case XBZRLE_BENCH_SPARSE:
+            for (j = 0; j < 8; j++) {
+                page[g_test_rand_int_range(0, XBZRLE_PAGE_SIZE)] ^= 0xff;
+            }
+            break;
+        case XBZRLE_BENCH_DENSE:
+            for (j = 0; j < XBZRLE_PAGE_SIZE; j += 16) {
+                memset(page + j, 0, 8);
+            }
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    }
+}
+
+static void bench_encode(XBZRLEBenchData *data, const char *name, int level)
+{
+    const int iterations = 16;
+    double total = (double)iterations * XBZRLE_PAGES * XBZRLE_PAGE_SIZE;
+    size_t off;
+    int i, j;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < XBZRLE_PAGES; j++) {
+            off = (size_t)j * XBZRLE_PAGE_SIZE;
+            data->encoded_len[j] =
+                xbzrle_encode_buffer(data->old + off, data->new + off,
+                                     XBZRLE_PAGE_SIZE, data->encoded + off,
+                                     XBZRLE_PAGE_SIZE);
+        }
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("encode(%s) accel level %d: %.2f GB/sec",
+                   name, level, total / g_test_timer_last() / GiB);
+}
+
+static void bench_decode(XBZRLEBenchData *data, const char *name)
+{
+    const int iterations = 16;
+    double total = (double)iterations * XBZRLE_PAGES * XBZRLE_PAGE_SIZE;
+    size_t off;
+    int i, j;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < XBZRLE_PAGES; j++) {
+            off = (size_t)j * XBZRLE_PAGE_SIZE;
+            if (data->encoded_len[j] > 0) {
+                xbzrle_decode_buffer(data->encoded + off,
+                                     data->encoded_len[j],
+                                     data->old + off, XBZRLE_PAGE_SIZE);
+            }
+        }
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("decode(%s): %.2f GB/sec",
+                   name, total / g_test_timer_last() / GiB);
+}
+
+/*
+ * The encoder implementation is selected globally, so walk every pattern
+ * for each accelerator in turn, from the preferred one (level 0) down to
+ * the generic C code.
+ */
+static void test_xbzrle_speed(void)
+{
+    XBZRLEBenchData data[XBZRLE_BENCH__MAX];
+    int level = 0;
+    int p;
+
+    for (p = 0; p < XBZRLE_BENCH__MAX; p++) {
+        data[p].old = g_malloc(XBZRLE_PAGES * XBZRLE_PAGE_SIZE);
+        data[p].new = g_malloc(XBZRLE_PAGES * XBZRLE_PAGE_SIZE);
+        data[p].encoded = g_malloc(XBZRLE_PAGES * XBZRLE_PAGE_SIZE);
+        data[p].encoded_len = g_new(int, XBZRLE_PAGES);
+        fill_pattern(&data[p], p);
+    }
+
+    do {
+        for (p = 0; p < XBZRLE_BENCH__MAX; p++) {
+            bench_encode(&data[p], pattern_names[p], level);
+        }
+        level++;
+    } while (test_xbzrle_encode_next_accel());
+
+    /* decoding overwrites the old pages, so do it last */
+    for (p = 0; p < XBZRLE_BENCH__MAX; p++) {
+        bench_decode(&data[p], pattern_names[p]);
+        g_free(data[p].old);
+        g_free(data[p].new);
+        g_free(data[p].encoded);
+        g_free(data[p].encoded_len);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/benchmark/speed", test_xbzrle_speed);
+
+    return g_test_run();
+}
@@ -0,0 +1,175 @@
+/*
+ * QTest testcase for the vCPU dirty page rate limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqos/libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+#endif
+
+/* Number of dirty ring entries per vCPU used by the tests */
+#define DIRTY_RING_SIZE 4096
+
+static bool kvm_dirty_ring_supported(void)
+{
+#if defined(__linux__) && defined(KVM_CAP_DIRTY_LOG_RING)
+    int ret, kvm_fd = open("/dev/kvm", O_RDWR);
+
+    if (kvm_fd < 0) {
+        return false;
+    }
+    ret = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+    close(kvm_fd);
+
+    /* the capability is the maximum ring size in bytes */
+    return ret >= DIRTY_RING_SIZE * sizeof(struct kvm_dirty_gfn);
+#else
+    return false;
+#endif
+}
+
+static QList *query_vcpu_dirty_limit(QTestState *qts)
+{
+    QDict *rsp = qtest_qmp(qts, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    QList *list;
+
+    g_assert(qdict_haskey(rsp, "return"));
+    list = qdict_get_qlist(rsp, "return");
+    qobject_ref(list);
+    qobject_unref(rsp);
+
+    return list;
+}
+
+static void assert_limit(QList *list, int64_t cpu_index, uint64_t rate)
+{
+    QListEntry *entry;
+
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *info = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (qdict_get_int(info, "cpu-index") == cpu_index) {
+            g_assert_cmpint(qdict_get_int(info, "limit-rate"), ==, rate);
+            return;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void test_no_dirty_ring(void)
+{
+    QTestState *qts = qtest_init("");
+    QDict *rsp;
+    QList *list;
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'set-vcpu-dirty-limit',"
+                         "  'arguments': { 'dirty-rate': 100 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    list = query_vcpu_dirty_limit(qts);
+    g_assert(qlist_empty(list));
+    qobject_unref(list);
+
+    /* Nothing to cancel */
+    rsp = qtest_qmp(qts, "{ 'execute': 'cancel-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    qtest_quit(qts);
+}
+
+static void test_set_query_cancel(void)
+{
+    QTestState *qts;
+    QDict *rsp;
+    QList *list;
+
+    if (!kvm_dirty_ring_supported()) {
+        g_test_skip("KVM dirty ring not available");
+        return;
+    }
+
+    qts = qtest_initf("-accel kvm,dirty-ring-size=%d -smp 2",
+                      DIRTY_RING_SIZE);
+
+    /* A single vCPU */
+    rsp = qtest_qmp(qts, "{ 'execute': 'set-vcpu-dirty-limit',"
+                         "  'arguments': { 'cpu-index': 1,"
+                         "                 'dirty-rate': 100 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    list = query_vcpu_dirty_limit(qts);
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    assert_limit(list, 1, 100);
+    qobject_unref(list);
+
+    /* All vCPUs */
+    rsp = qtest_qmp(qts, "{ 'execute': 'set-vcpu-dirty-limit',"
+                         "  'arguments': { 'dirty-rate': 200 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    list = query_vcpu_dirty_limit(qts);
+    g_assert_cmpint(qlist_size(list), ==, 2);
+    assert_limit(list, 0, 200);
+    assert_limit(list, 1, 200);
+    qobject_unref(list);
+
+    /* Invalid arguments */
+    rsp = qtest_qmp(qts, "{ 'execute': 'set-vcpu-dirty-limit',"
+                         "  'arguments': { 'cpu-index': 2,"
+                         "                 'dirty-rate': 100 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+    rsp = qtest_qmp(qts, "{ 'execute': 'set-vcpu-dirty-limit',"
+                         "  'arguments': { 'dirty-rate': 0 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    /* Cancel one vCPU, then the rest */
+    rsp = qtest_qmp(qts, "{ 'execute': 'cancel-vcpu-dirty-limit',"
+                         "  'arguments': { 'cpu-index': 0 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    list = query_vcpu_dirty_limit(qts);
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    assert_limit(list, 1, 200);
+    qobject_unref(list);
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'cancel-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    list = query_vcpu_dirty_limit(qts);
+    g_assert(qlist_empty(list));
+    qobject_unref(list);
+
+    /* Dirty logging was stopped, so a new limit starts it again */
+    rsp = qtest_qmp(qts, "{ 'execute': 'set-vcpu-dirty-limit',"
+                         "  'arguments': { 'dirty-rate': 100 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/dirtylimit/no-dirty-ring", test_no_dirty_ring);
+    qtest_add_func("/dirtylimit/set-query-cancel", test_set_query_cancel);
+
+    return g_test_run();
+}
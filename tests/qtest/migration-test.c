@@ -845,7 +845,7 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
-static void test_precopy_unix(void)
+static void do_test_precopy_unix(int load_threads)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     MigrateStart *args = migrate_start_new();
@@ -855,6 +855,8 @@ static void test_precopy_unix(void)
         return;
     }
 
+    migrate_set_parameter_int(to, "load-threads", load_threads);
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -886,6 +888,16 @@ static void test_precopy_unix(void)
     g_free(uri);
 }
 
+static void test_precopy_unix(void)
+{
+    do_test_precopy_unix(0);
+}
+
+static void test_precopy_unix_load_threads(void)
+{
+    do_test_precopy_unix(4);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -1266,7 +1278,7 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+static void test_multifd_tcp_full(const char *method, bool zero_page)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1296,6 +1308,11 @@ static void test_multifd_tcp(const char *method)
     migrate_set_capability(from, "multifd", "true");
     migrate_set_capability(to, "multifd", "true");
 
+    if (zero_page) {
+        migrate_set_capability(from, "multifd-zero-page", "true");
+        migrate_set_capability(to, "multifd-zero-page", "true");
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1323,6 +1340,11 @@ static void test_multifd_tcp(const char *method)
     g_free(uri);
 }
 
+static void test_multifd_tcp(const char *method)
+{
+    test_multifd_tcp_full(method, false);
+}
+
 static void test_multifd_tcp_none(void)
 {
     test_multifd_tcp("none");
@@ -1340,6 +1362,23 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    test_multifd_tcp("lz4");
+}
+#endif
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    test_multifd_tcp("xbzrle");
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp_full("none", true);
+}
+
 /*
  * This test does:
  *  source               target
@@ -1489,6 +1528,8 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
+    qtest_add_func("/migration/precopy/unix/load-threads",
+                   test_precopy_unix_load_threads);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
@@ -1507,6 +1548,12 @@ int main(int argc, char **argv)
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/lz4", test_multifd_tcp_lz4);
+#endif
+    qtest_add_func("/migration/multifd/tcp/xbzrle", test_multifd_tcp_xbzrle);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
 
     ret = g_test_run();
 
@@ -174,6 +174,80 @@ static void test_encode_decode(void)
     }
 }
 
+static void fill_random_diff(uint8_t *old, uint8_t *new, int max_run)
+{
+    int i, j, pos, len;
+    int nr_runs = g_test_rand_int_range(0, 200);
+
+    for (i = 0; i < XBZRLE_PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, XBZRLE_PAGE_SIZE);
+
+    for (i = 0; i < nr_runs; i++) {
+        pos = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_run + 1);
+        for (j = pos; j < XBZRLE_PAGE_SIZE && j < pos + len; j++) {
+            new[j] = ~old[j];
+        }
+    }
+}
+
+#define ACCEL_TEST_PAGES 1000
+
+/*
+ * Every accelerated encoder must produce exactly the same stream as the
+ * generic one, including the cases where the destination overflows.  The
+ * reference streams come from the preferred encoder, then each of the
+ * remaining ones (down to the generic C code) re-encodes the same pages.
+ */
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(ACCEL_TEST_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(ACCEL_TEST_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *ref = g_malloc(ACCEL_TEST_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *decoded = g_malloc(XBZRLE_PAGE_SIZE);
+    int ref_len[ACCEL_TEST_PAGES], dlen[ACCEL_TEST_PAGES];
+    size_t off;
+    int rc, i;
+
+    for (i = 0; i < ACCEL_TEST_PAGES; i++) {
+        off = (size_t)i * XBZRLE_PAGE_SIZE;
+        fill_random_diff(old + off, new + off, (i % 4) * 64 + 1);
+        dlen[i] = i % 5 ? XBZRLE_PAGE_SIZE :
+                  g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+        ref_len[i] = xbzrle_encode_buffer(old + off, new + off,
+                                          XBZRLE_PAGE_SIZE, ref + off,
+                                          dlen[i]);
+        if (ref_len[i] > 0) {
+            memcpy(decoded, old + off, XBZRLE_PAGE_SIZE);
+            rc = xbzrle_decode_buffer(ref + off, ref_len[i], decoded,
+                                      XBZRLE_PAGE_SIZE);
+            g_assert(rc <= XBZRLE_PAGE_SIZE);
+            g_assert(memcmp(decoded, new + off, XBZRLE_PAGE_SIZE) == 0);
+        }
+    }
+
+    while (test_xbzrle_encode_next_accel()) {
+        for (i = 0; i < ACCEL_TEST_PAGES; i++) {
+            off = (size_t)i * XBZRLE_PAGE_SIZE;
+            rc = xbzrle_encode_buffer(old + off, new + off, XBZRLE_PAGE_SIZE,
+                                      compressed, dlen[i]);
+            g_assert_cmpint(rc, ==, ref_len[i]);
+            if (rc > 0) {
+                g_assert(memcmp(compressed, ref + off, rc) == 0);
+            }
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+    g_free(decoded);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +260,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
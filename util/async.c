@@ -330,6 +330,11 @@ aio_ctx_finalize(GSource     *source)
         luring_cleanup(ctx->linux_io_uring);
         ctx->linux_io_uring = NULL;
     }
+    if (ctx->linux_io_uring_iopoll) {
+        luring_detach_aio_context(ctx->linux_io_uring_iopoll, ctx);
+        luring_cleanup(ctx->linux_io_uring_iopoll);
+        ctx->linux_io_uring_iopoll = NULL;
+    }
 #endif
 
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
@@ -401,7 +406,9 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(false, ctx->io_uring_sqpoll,
+                                      ctx->io_uring_sqpoll_idle_ms,
+                                      ctx->io_uring_sqpoll_cpu, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -415,7 +422,76 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
     assert(ctx->linux_io_uring);
     return ctx->linux_io_uring;
 }
+
+LuringState *aio_setup_linux_io_uring_iopoll(AioContext *ctx, Error **errp)
+{
+    if (ctx->linux_io_uring_iopoll) {
+        return ctx->linux_io_uring_iopoll;
+    }
+
+    ctx->linux_io_uring_iopoll = luring_init(true, ctx->io_uring_sqpoll,
+                                             ctx->io_uring_sqpoll_idle_ms,
+                                             ctx->io_uring_sqpoll_cpu, errp);
+    if (!ctx->linux_io_uring_iopoll) {
+        return NULL;
+    }
+
+    luring_attach_aio_context(ctx->linux_io_uring_iopoll, ctx);
+    return ctx->linux_io_uring_iopoll;
+}
+
+LuringState *aio_get_linux_io_uring_iopoll(AioContext *ctx)
+{
+    assert(ctx->linux_io_uring_iopoll);
+    return ctx->linux_io_uring_iopoll;
+}
+#endif
+
+bool aio_get_io_uring_sqpoll_stats(AioContext *ctx, uint64_t *submits,
+                                   uint64_t *wakeups)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    bool ret = false;
+
+    aio_context_acquire(ctx);
+    if (ctx->linux_io_uring) {
+        ret = luring_get_sqpoll_stats(ctx->linux_io_uring, submits, wakeups);
+    }
+    aio_context_release(ctx);
+    return ret;
+#else
+    return false;
+#endif
+}
+
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     uint32_t sqpoll_idle_ms, int sqpoll_cpu,
+                                     Error **errp)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring || ctx->linux_io_uring_iopoll) {
+        error_setg(errp, "io_uring parameters cannot be changed while "
+                   "io_uring is in use");
+        return;
+    }
+
+    ctx->io_uring_sqpoll = sqpoll;
+    ctx->io_uring_sqpoll_idle_ms = sqpoll_idle_ms;
+    ctx->io_uring_sqpoll_cpu = sqpoll_cpu;
+
+    /*
+     * Report a kernel without SQPOLL support to whoever asked for it,
+     * rather than having file-posix fall back to the thread pool later.
+     */
+    if (sqpoll) {
+        aio_setup_linux_io_uring(ctx, errp);
+    }
+#else
+    if (sqpoll) {
+        error_setg(errp, "io_uring is not supported in this build");
+    }
 #endif
+}
 
 void aio_notify(AioContext *ctx)
 {
@@ -526,6 +602,10 @@ AioContext *aio_context_new(Error **errp)
 
 #ifdef CONFIG_LINUX_IO_URING
     ctx->linux_io_uring = NULL;
+    ctx->linux_io_uring_iopoll = NULL;
+    ctx->io_uring_sqpoll = false;
+    ctx->io_uring_sqpoll_idle_ms = 0;
+    ctx->io_uring_sqpoll_cpu = -1;
 #endif
 
     ctx->thread_pool = NULL;
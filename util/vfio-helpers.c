@@ -23,10 +23,9 @@
 #include "qemu/event_notifier.h"
 #include "qemu/vfio-helpers.h"
 #include "qemu/lockable.h"
+#include "qemu/iova-tree.h"
 #include "trace.h"
 
-#define QEMU_VFIO_DEBUG 0
-
 #define QEMU_VFIO_IOVA_MIN 0x10000ULL
 /* XXX: Once VFIO exposes the iova bit width in the IOMMU capability interface,
  * we can use a runtime limit; alternatively it's also possible to do platform
@@ -34,13 +33,6 @@
  **/
 #define QEMU_VFIO_IOVA_MAX (1ULL << 39)
 
-typedef struct {
-    /* Page aligned addr. */
-    void *host;
-    size_t size;
-    uint64_t iova;
-} IOVAMapping;
-
 struct IOVARange {
     uint64_t start;
     uint64_t end;
@@ -96,8 +88,11 @@ struct QEMUVFIOState {
      **/
     uint64_t low_water_mark;
     uint64_t high_water_mark;
-    IOVAMapping *mappings;
-    int nr_mappings;
+    /*
+     * Fixed mappings, indexed by host address: in each DMAMap, @iova is the
+     * page aligned host address and @translated_addr the IOVA.
+     */
+    IOVATree *mappings;
 };
 
 /**
@@ -463,8 +458,15 @@ static void qemu_vfio_ram_block_added(RAMBlockNotifier *n,
                                       void *host, size_t size)
 {
     QEMUVFIOState *s = container_of(n, QEMUVFIOState, ram_notifier);
+    int ret;
+
     trace_qemu_vfio_ram_block_added(s, host, size);
-    qemu_vfio_dma_map(s, host, size, false, NULL);
+    ret = qemu_vfio_dma_map(s, host, size, false, NULL);
+    if (ret) {
+        warn_report("Cannot map RAM block %p (size 0x%zx) for DMA, requests "
+                    "to it will use temporary mappings: %s",
+                    host, size, strerror(-ret));
+    }
 }
 
 static void qemu_vfio_ram_block_removed(RAMBlockNotifier *n,
@@ -498,6 +500,7 @@ static int qemu_vfio_init_ramblock(RAMBlock *rb, void *opaque)
 static void qemu_vfio_open_common(QEMUVFIOState *s)
 {
     qemu_mutex_init(&s->lock);
+    s->mappings = iova_tree_new();
     s->ram_notifier.ram_block_added = qemu_vfio_ram_block_added;
     s->ram_notifier.ram_block_removed = qemu_vfio_ram_block_removed;
     ram_block_notifier_add(&s->ram_notifier);
@@ -535,88 +538,56 @@ QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp)
     return s;
 }
 
+static gboolean qemu_vfio_dump_mapping(DMAMap *map)
+{
+    trace_qemu_vfio_dump_mapping((void *)(uintptr_t)map->iova,
+                                 map->translated_addr, map->size + 1);
+    return false;
+}
+
 static void qemu_vfio_dump_mappings(QEMUVFIOState *s)
 {
-    for (int i = 0; i < s->nr_mappings; ++i) {
-        trace_qemu_vfio_dump_mapping(s->mappings[i].host,
-                                     s->mappings[i].iova,
-                                     s->mappings[i].size);
+    if (trace_event_get_state_backends(TRACE_QEMU_VFIO_DUMP_MAPPING)) {
+        iova_tree_foreach(s->mappings, qemu_vfio_dump_mapping);
     }
 }
 
 /**
- * Find the mapping entry that contains [host, host + size) and set @index to
- * the position. If no entry contains it, @index is the position _after_ which
- * to insert the new mapping. IOW, it is the index of the largest element that
- * is smaller than @host, or -1 if no entry is.
+ * Find the fixed mapping that contains @host, or NULL if there is none.
  */
-static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host,
-                                           int *index)
+static const DMAMap *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host)
 {
-    IOVAMapping *p = s->mappings;
-    IOVAMapping *q = p ? p + s->nr_mappings - 1 : NULL;
-    IOVAMapping *mid;
     trace_qemu_vfio_find_mapping(s, host);
-    if (!p) {
-        *index = -1;
-        return NULL;
-    }
-    while (true) {
-        mid = p + (q - p) / 2;
-        if (mid == p) {
-            break;
-        }
-        if (mid->host > host) {
-            q = mid;
-        } else if (mid->host < host) {
-            p = mid;
-        } else {
-            break;
-        }
-    }
-    if (mid->host > host) {
-        mid--;
-    } else if (mid < &s->mappings[s->nr_mappings - 1]
-               && (mid + 1)->host <= host) {
-        mid++;
-    }
-    *index = mid - &s->mappings[0];
-    if (mid >= &s->mappings[0] &&
-        mid->host <= host && mid->host + mid->size > host) {
-        assert(mid < &s->mappings[s->nr_mappings]);
-        return mid;
-    }
-    /* At this point *index + 1 is the right position to insert the new
-     * mapping.*/
-    return NULL;
+    return iova_tree_find_address(s->mappings, (uintptr_t)host);
+}
+
+/* Whether [host, host + size) lies entirely within @mapping */
+static bool qemu_vfio_mapping_contains(const DMAMap *mapping,
+                                       void *host, size_t size)
+{
+    return (uintptr_t)host >= mapping->iova &&
+           (uintptr_t)host + size - 1 <= mapping->iova + mapping->size;
 }
 
 /**
- * Allocate IOVA and create a new mapping record and insert it in @s.
+ * Record a new fixed mapping in @s.
  */
-static IOVAMapping *qemu_vfio_add_mapping(QEMUVFIOState *s,
-                                          void *host, size_t size,
-                                          int index, uint64_t iova)
+static int qemu_vfio_add_mapping(QEMUVFIOState *s, void *host, size_t size,
+                                 uint64_t iova)
 {
-    int shift;
-    IOVAMapping m = {.host = host, .size = size, .iova = iova};
-    IOVAMapping *insert;
+    DMAMap m = {
+        .iova = (uintptr_t)host,
+        .translated_addr = iova,
+        .size = size - 1,
+        .perm = IOMMU_RW,
+    };
 
     assert(QEMU_IS_ALIGNED(size, qemu_real_host_page_size));
     assert(QEMU_IS_ALIGNED(s->low_water_mark, qemu_real_host_page_size));
     assert(QEMU_IS_ALIGNED(s->high_water_mark, qemu_real_host_page_size));
-    trace_qemu_vfio_new_mapping(s, host, size, index, iova);
-
-    assert(index >= 0);
-    s->nr_mappings++;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
-    insert = &s->mappings[index];
-    shift = s->nr_mappings - index - 1;
-    if (shift) {
-        memmove(insert + 1, insert, shift * sizeof(s->mappings[0]));
-    }
-    *insert = m;
-    return insert;
+    trace_qemu_vfio_new_mapping(s, host, size, iova);
+
+    return iova_tree_insert(s->mappings, &m) == IOVA_OK ? 0 : -EEXIST;
 }
 
 /* Do the DMA mapping with VFIO. */
@@ -640,52 +611,25 @@ static int qemu_vfio_do_mapping(QEMUVFIOState *s, void *host, size_t size,
 }
 
 /**
- * Undo the DMA mapping from @s with VFIO, and remove from mapping list.
+ * Undo the DMA mapping from @s with VFIO, and remove from mapping tree.
  */
-static void qemu_vfio_undo_mapping(QEMUVFIOState *s, IOVAMapping *mapping,
+static void qemu_vfio_undo_mapping(QEMUVFIOState *s, const DMAMap *mapping,
                                    Error **errp)
 {
-    int index;
+    /* @mapping is freed by iova_tree_remove() */
+    DMAMap m = *mapping;
     struct vfio_iommu_type1_dma_unmap unmap = {
         .argsz = sizeof(unmap),
         .flags = 0,
-        .iova = mapping->iova,
-        .size = mapping->size,
+        .iova = m.translated_addr,
+        .size = m.size + 1,
     };
 
-    index = mapping - s->mappings;
-    assert(mapping->size > 0);
-    assert(QEMU_IS_ALIGNED(mapping->size, qemu_real_host_page_size));
-    assert(index >= 0 && index < s->nr_mappings);
+    assert(QEMU_IS_ALIGNED(m.size + 1, qemu_real_host_page_size));
     if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
         error_setg_errno(errp, errno, "VFIO_UNMAP_DMA failed");
     }
-    memmove(mapping, &s->mappings[index + 1],
-            sizeof(s->mappings[0]) * (s->nr_mappings - index - 1));
-    s->nr_mappings--;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
-}
-
-/* Check if the mapping list is (ascending) ordered. */
-static bool qemu_vfio_verify_mappings(QEMUVFIOState *s)
-{
-    int i;
-    if (QEMU_VFIO_DEBUG) {
-        for (i = 0; i < s->nr_mappings - 1; ++i) {
-            if (!(s->mappings[i].host < s->mappings[i + 1].host)) {
-                fprintf(stderr, "item %d not sorted!\n", i);
-                qemu_vfio_dump_mappings(s);
-                return false;
-            }
-            if (!(s->mappings[i].host + s->mappings[i].size <=
-                  s->mappings[i + 1].host)) {
-                fprintf(stderr, "item %d overlap with next!\n", i);
-                qemu_vfio_dump_mappings(s);
-                return false;
-            }
-        }
-    }
-    return true;
+    iova_tree_remove(s->mappings, &m);
 }
 
 static int
@@ -741,39 +685,41 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
                       bool temporary, uint64_t *iova)
 {
     int ret = 0;
-    int index;
-    IOVAMapping *mapping;
+    const DMAMap *mapping;
     uint64_t iova0;
 
     assert(QEMU_PTR_IS_ALIGNED(host, qemu_real_host_page_size));
     assert(QEMU_IS_ALIGNED(size, qemu_real_host_page_size));
     trace_qemu_vfio_dma_map(s, host, size, temporary, iova);
     qemu_mutex_lock(&s->lock);
-    mapping = qemu_vfio_find_mapping(s, host, &index);
-    if (mapping) {
-        iova0 = mapping->iova + ((uint8_t *)host - (uint8_t *)mapping->host);
+    mapping = qemu_vfio_find_mapping(s, host);
+    if (mapping && qemu_vfio_mapping_contains(mapping, host, size)) {
+        iova0 = mapping->translated_addr +
+                ((uintptr_t)host - mapping->iova);
     } else {
         if (s->high_water_mark - s->low_water_mark + 1 < size) {
             ret = -ENOMEM;
             goto out;
         }
         if (!temporary) {
-            if (qemu_vfio_find_fixed_iova(s, size, &iova0)) {
-                ret = -ENOMEM;
+            DMAMap range = { .iova = (uintptr_t)host, .size = size - 1 };
+
+            /* Fixed mappings must not overlap */
+            if (iova_tree_find(s->mappings, &range)) {
+                ret = -EEXIST;
                 goto out;
             }
-
-            mapping = qemu_vfio_add_mapping(s, host, size, index + 1, iova0);
-            if (!mapping) {
+            if (qemu_vfio_find_fixed_iova(s, size, &iova0)) {
                 ret = -ENOMEM;
                 goto out;
             }
-            assert(qemu_vfio_verify_mappings(s));
+
             ret = qemu_vfio_do_mapping(s, host, size, iova0);
             if (ret) {
-                qemu_vfio_undo_mapping(s, mapping, NULL);
                 goto out;
             }
+            ret = qemu_vfio_add_mapping(s, host, size, iova0);
+            assert(ret == 0);
             qemu_vfio_dump_mappings(s);
         } else {
             if (qemu_vfio_find_temp_iova(s, size, &iova0)) {
@@ -795,6 +741,26 @@ out:
     return ret;
 }
 
+/*
+ * Look up the IOVA of [host, host + size) in the fixed mappings, which cover
+ * all of guest RAM.  Unlike qemu_vfio_dma_map() this never creates a
+ * mapping, so callers don't need to serialize with temporary mappings.
+ * Returns true and stores the IOVA in @iova if the whole area is mapped.
+ */
+bool qemu_vfio_dma_lookup(QEMUVFIOState *s, void *host, size_t size,
+                          uint64_t *iova)
+{
+    const DMAMap *mapping;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    mapping = qemu_vfio_find_mapping(s, host);
+    if (!mapping || !qemu_vfio_mapping_contains(mapping, host, size)) {
+        return false;
+    }
+    *iova = mapping->translated_addr + ((uintptr_t)host - mapping->iova);
+    return true;
+}
+
 /* Reset the high watermark and free all "temporary" mappings. */
 int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
 {
@@ -818,8 +784,7 @@ int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
  * qemu_vfio_dma_map(). */
 void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
 {
-    int index = 0;
-    IOVAMapping *m;
+    const DMAMap *m;
 
     if (!host) {
         return;
@@ -827,7 +792,7 @@ void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
 
     trace_qemu_vfio_dma_unmap(s, host);
     qemu_mutex_lock(&s->lock);
-    m = qemu_vfio_find_mapping(s, host, &index);
+    m = qemu_vfio_find_mapping(s, host);
     if (!m) {
         goto out;
     }
@@ -844,14 +809,16 @@ static void qemu_vfio_reset(QEMUVFIOState *s)
 /* Close and free the VFIO resources. */
 void qemu_vfio_close(QEMUVFIOState *s)
 {
-    int i;
+    DMAMap all = { .iova = 0, .size = HWADDR_MAX };
+    const DMAMap *m;
 
     if (!s) {
         return;
     }
-    for (i = 0; i < s->nr_mappings; ++i) {
-        qemu_vfio_undo_mapping(s, &s->mappings[i], NULL);
+    while ((m = iova_tree_find(s->mappings, &all))) {
+        qemu_vfio_undo_mapping(s, m, NULL);
     }
+    iova_tree_destroy(s->mappings);
     ram_block_notifier_remove(&s->ram_notifier);
     g_free(s->usable_iova_ranges);
     s->nb_iova_ranges = 0;